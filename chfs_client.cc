@@ -2,14 +2,17 @@
 #include "chfs_client.h"
 
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include <iostream>
+#include <mutex>
 #include <sstream>
 
+#include "dir_format.h"
 #include "extent_client.h"
 
 /*
@@ -19,6 +22,27 @@
  * ahead log to achive all-or-nothing for these transactions.
  */
 
+// A directory read and written in place through the ranged extent calls,
+// so an index operation moves only the pages it touches.
+class ec_dir_store : public dir_store {
+  extent_client *ec;
+  extent_protocol::extentid_t dir;
+
+ public:
+  ec_dir_store(extent_client *ec, extent_protocol::extentid_t dir)
+      : ec(ec), dir(dir) {}
+  int read(unsigned int off, unsigned int len, std::string &buf) {
+    return ec->read(dir, off, len, buf);
+  }
+  int write(unsigned int off, const std::string &buf) {
+    int written = 0;
+    int r = ec->write(dir, off, buf, written);
+    if (r == extent_protocol::OK && written != (int)buf.size())
+      r = extent_protocol::IOERR;
+    return r;
+  }
+};
+
 chfs_client::chfs_client() { ec = new extent_client(); }
 
 chfs_client::chfs_client(std::string extent_dst, std::string lock_dst) {
@@ -30,14 +54,12 @@ chfs_client::chfs_client(std::string extent_dst, std::string lock_dst) {
 txid_t chfs_client::begin_transaction() {
   // BEGIN
   printf("begin_transaction\n");
-  txid_t txid = ec->get_next_txid();
-  ec->append_log(new chfs_command_begin(txid));
-  return txid;
+  return ec->begin_tx();
 }
 
 void chfs_client::commit_transaction(txid_t txid) {
   // COMMIT
-  ec->append_log(new chfs_command_commit(txid));
+  ec->commit_tx(txid);
 }
 
 chfs_client::inum chfs_client::n2i(std::string n) {
@@ -53,6 +75,90 @@ std::string chfs_client::filename(inum inum) {
   return ost.str();
 }
 
+std::string chfs_client::dcache_key(inum parent, const char *name) {
+  // '/' can't appear in a name
+  return std::to_string(parent) + "/" + name;
+}
+
+bool chfs_client::dcache_get(inum parent, const char *name, inum &ino) {
+  std::lock_guard<std::mutex> lock(dcache_mtx);
+  auto it = dcache.find(dcache_key(parent, name));
+  if (it == dcache.end()) return false;
+  ino = it->second;
+  return true;
+}
+
+void chfs_client::dcache_put(inum parent, const char *name, inum ino) {
+  std::lock_guard<std::mutex> lock(dcache_mtx);
+  if (dcache.size() >= DCACHE_SIZE) {
+    // make room a quarter at a time, as the inode cache does
+    for (auto v = dcache.begin();
+         v != dcache.end() && dcache.size() >= DCACHE_SIZE * 3 / 4;)
+      v = dcache.erase(v);
+  }
+  dcache[dcache_key(parent, name)] = ino;
+}
+
+void chfs_client::dcache_drop(inum parent, const char *name) {
+  std::lock_guard<std::mutex> lock(dcache_mtx);
+  dcache.erase(dcache_key(parent, name));
+}
+
+void chfs_client::dcache_drop_dir(inum dir) {
+  std::string prefix = std::to_string(dir) + "/";
+  std::lock_guard<std::mutex> lock(dcache_mtx);
+  for (auto v = dcache.begin(); v != dcache.end();) {
+    if (v->first.compare(0, prefix.size(), prefix) == 0)
+      v = dcache.erase(v);
+    else
+      ++v;
+  }
+}
+
+void chfs_client::acache_put(inum ino, const statinfo &st,
+                             unsigned long epoch) {
+  std::lock_guard<std::mutex> lock(acache_mtx);
+  // something changed since st was read
+  if (epoch != acache_epoch) return;
+  if (acache.size() >= ACACHE_SIZE) {
+    for (auto v = acache.begin();
+         v != acache.end() && acache.size() >= ACACHE_SIZE * 3 / 4;)
+      v = acache.erase(v);
+  }
+  acache[ino] = prefetched{st, std::chrono::steady_clock::now()};
+}
+
+bool chfs_client::acache_take(inum ino, statinfo &st) {
+  std::lock_guard<std::mutex> lock(acache_mtx);
+  auto it = acache.find(ino);
+  if (it == acache.end()) return false;
+  bool fresh = std::chrono::steady_clock::now() - it->second.at < ACACHE_TTL;
+  if (fresh) st = it->second.st;
+  acache.erase(it);
+  return fresh;
+}
+
+unsigned long chfs_client::acache_begin() {
+  std::lock_guard<std::mutex> lock(acache_mtx);
+  return acache_epoch;
+}
+
+void chfs_client::acache_drop(inum ino) {
+  std::lock_guard<std::mutex> lock(acache_mtx);
+  acache.erase(ino);
+  acache_epoch++;
+}
+
+static void fill_statinfo(const extent_protocol::attr &a,
+                          chfs_client::statinfo &st) {
+  st.type = a.type;
+  st.size = a.size;
+  st.atime = a.atime;
+  st.mtime = a.mtime;
+  st.ctime = a.ctime;
+  st.gen = a.gen;
+}
+
 bool chfs_client::isfile(inum inum) {
   extent_protocol::attr a;
 
@@ -143,6 +249,31 @@ release:
   return r;
 }
 
+// NOENT if inum isn't in use
+int chfs_client::stat(inum inum, statinfo &st) {
+  int r = OK;
+
+  printf("stat %016llx\n", inum);
+  extent_protocol::attr a;
+  if (!acache_take(inum, st)) {
+    if (ec->getattr(inum, a) != extent_protocol::OK) {
+      r = IOERR;
+      goto release;
+    }
+    fill_statinfo(a, st);
+  }
+  // a prefetched entry can be of an inode freed since, too
+  if (st.type == 0) {
+    r = NOENT;
+    goto release;
+  }
+
+  printf("stat %016llx -> type %u sz %llu\n", inum, st.type, st.size);
+
+release:
+  return r;
+}
+
 #define EXT_RPC(xx)                                          \
   do {                                                       \
     if ((xx) != extent_protocol::OK) {                       \
@@ -162,6 +293,7 @@ int chfs_client::setattr(inum ino, size_t size) {
    * note: get the content of inode ino, and modify its content
    * according to the size (<, =, or >) content length.
    */
+  std::unique_lock<std::shared_mutex> lock(ns_lock(ino));
   txid_t txid = begin_transaction();
 
   std::string buf;
@@ -171,6 +303,7 @@ int chfs_client::setattr(inum ino, size_t size) {
   if ((r = ec->put(ino, buf)) != OK) goto commit;
 
 commit:
+  acache_drop(ino);
   commit_transaction(txid);
   return r;
 }
@@ -186,11 +319,11 @@ int chfs_client::create(inum parent, const char *name, mode_t mode,
    * after create file or dir, you must remember to modify the parent
    * infomation.
    */
+  std::unique_lock<std::shared_mutex> lock(ns_lock(parent));
   txid_t txid = begin_transaction();
 
   bool found;
-  std::string buf;
-  if ((r = lookup(parent, name, found, ino_out)) != OK) goto commit;
+  if ((r = lookup_nolock(parent, name, found, ino_out)) != OK) goto commit;
   if (found) {
     commit_transaction(txid);
     return EXIST;
@@ -200,12 +333,14 @@ int chfs_client::create(inum parent, const char *name, mode_t mode,
   if ((r = ec->create(extent_protocol::T_FILE, ino_out)) != OK) goto commit;
 
   // add an entry into parent
-
-  if ((r = ec->get(parent, buf)) != OK) goto commit;
-  buf.append(std::string(name) + "/" + filename(ino_out) + "/");
-  if ((r = ec->put(parent, buf)) != OK) goto commit;
+  if ((r = ec->dir_add(parent, name, ino_out)) != OK) {
+    dcache_drop(parent, name);
+    goto commit;
+  }
+  dcache_put(parent, name, ino_out);
 
 commit:
+  acache_drop(parent);
   commit_transaction(txid);
   return r;
 }
@@ -222,12 +357,12 @@ int chfs_client::mkdir(inum parent, const char *name, mode_t mode,
    * infomation.
    */
 
+  std::unique_lock<std::shared_mutex> lock(ns_lock(parent));
   txid_t txid = begin_transaction();
 
   bool found;
-  std::string buf;
 
-  if ((r = lookup(parent, name, found, ino_out)) != OK) goto commit;
+  if ((r = lookup_nolock(parent, name, found, ino_out)) != OK) goto commit;
   if (found) {
     commit_transaction(txid);
     return EXIST;
@@ -237,40 +372,67 @@ int chfs_client::mkdir(inum parent, const char *name, mode_t mode,
   if ((r = ec->create(extent_protocol::T_DIR, ino_out)) != OK) goto commit;
 
   // add an entry into parent
-  if ((r = ec->get(parent, buf)) != OK) goto commit;
-  buf.append(std::string(name) + "/" + filename(ino_out) + "/");
-  if ((r = ec->put(parent, buf)) != OK) goto commit;
+  if ((r = ec->dir_add(parent, name, ino_out)) != OK) {
+    dcache_drop(parent, name);
+    goto commit;
+  }
+  dcache_put(parent, name, ino_out);
 
 commit:
+  acache_drop(parent);
   commit_transaction(txid);
   return r;
 }
 
 int chfs_client::lookup(inum parent, const char *name, bool &found,
                         inum &ino_out) {
+  std::shared_lock<std::shared_mutex> lock(ns_lock(parent));
+  return lookup_nolock(parent, name, found, ino_out);
+}
+
+int chfs_client::lookup_nolock(inum parent, const char *name, bool &found,
+                               inum &ino_out) {
   int r = OK;
 
-  std::list<dirent> list;
-  if ((r = readdir(parent, list)) != OK) {
+  inum cached;
+  if (dcache_get(parent, name, cached)) {
+    found = cached != 0;
+    if (found) ino_out = cached;
     return r;
   }
-  for (auto x : list) {
-    if (x.name == name) {
-      found = true;
-      ino_out = x.inum;
-      return r;
-    }
-  }
+
+  // hashes straight to the leaf that may hold name
+  ec_dir_store ds(ec, parent);
+  uint32_t ino;
   found = false;
+  r = dir_index(&ds).lookup(name, ino);
+  if (r == NOENT) {
+    dcache_put(parent, name, 0);
+    return OK;
+  }
+  if (r != OK) return r;
+  found = true;
+  ino_out = ino;
+  dcache_put(parent, name, ino);
 
   return r;
 }
 
 int chfs_client::readdir(inum dir, std::list<dirent> &list) {
+  return readdir(dir, 0, UINT_MAX, list);
+}
+
+int chfs_client::readdir(inum dir, unsigned long long cursor, unsigned int max,
+                         std::list<dirent> &list) {
+  std::shared_lock<std::shared_mutex> lock(ns_lock(dir));
+  return readdir_nolock(dir, cursor, max, list);
+}
+
+int chfs_client::readdir_nolock(inum dir, unsigned long long cursor,
+                                unsigned int max, std::list<dirent> &list) {
   // my directory format: name/inum/name/inum/name/inum...
   int r = OK;
   // printf("readdir in dir %016llx\n", dir);
-  std::string buf;
   extent_protocol::attr a;
   if (ec->getattr(dir, a) != OK) {
     r = IOERR;
@@ -282,27 +444,19 @@ int chfs_client::readdir(inum dir, std::list<dirent> &list) {
     return r;
   }
 
-  if (ec->get(dir, buf) != OK) {
+  ec_dir_store ds(ec, dir);
+  std::list<dir_entry> entries;
+  if (dir_index(&ds).list(cursor, max, entries) != OK) {
     r = IOERR;
     return r;
   }
 
-  size_t name_start = 0;
-  size_t name_end = buf.find('/');
-  while (name_end != std::string::npos) {
-    std::string name = buf.substr(name_start, name_end - name_start);
-    size_t inum_start = name_end + 1;
-    size_t inum_end = buf.find('/', inum_start);
-    std::string inum = buf.substr(inum_start, inum_end - inum_start);
-
+  for (auto &x : entries) {
     struct dirent entry;
-    entry.name = name;
-    entry.inum = n2i(inum);
-
+    entry.name = x.name;
+    entry.inum = x.inum;
+    entry.cursor = x.cursor;
     list.push_back(entry);
-
-    name_start = inum_end + 1;
-    name_end = buf.find('/', name_start);
   }
 
   return r;
@@ -316,13 +470,12 @@ int chfs_client::read(inum ino, size_t size, off_t off, std::string &data) {
    * note: read using ec->get().
    */
 
-  std::string buf;
-  if ((r = ec->get(ino, buf)) != OK) return r;
-
-  if ((size_t)off > buf.length())
+  // only the requested range crosses to the extent server
+  if (off < 0 || (uint64_t)off > UINT_MAX) {
     data = "";
-  else
-    data = buf.substr(off, size);
+    return r;
+  }
+  r = ec->read(ino, off, size, data);
 
   return r;
 }
@@ -337,24 +490,20 @@ int chfs_client::write(inum ino, size_t size, off_t off, const char *data,
    * note: write using ec->put().
    * when off > length of original file, fill the holes with '\0'.
    */
+  if (off < 0 || (uint64_t)off + size > UINT_MAX) return IOERR;
+  std::unique_lock<std::shared_mutex> lock(ns_lock(ino));
   txid_t txid = begin_transaction();
 
-  std::string buf, str(data, size);
-  if ((r = ec->get(ino, buf)) != OK) goto commit;
-
-  if ((size_t)off > buf.length()) {
-    // size_t len = buf.length();
-    buf.resize(off + size);
-    buf.replace(off, size, str);
-    bytes_written = size;  // Why size ? buf.length()-len 不能通过测试
-  } else {
-    buf.replace(off, size, str);
-    bytes_written = size;
-  }
-
-  if ((r = ec->put(ino, buf)) != OK) goto commit;
+  // the extent server zero-fills past EOF itself, so only the new bytes
+  // are sent
+  int written = 0;
+  if ((r = ec->write(ino, off, std::string(data, size), written)) != OK)
+    goto commit;
+  // short only if the disk filled up
+  bytes_written = written;
 
 commit:
+  acache_drop(ino);
   commit_transaction(txid);
   return r;
 }
@@ -369,29 +518,50 @@ int chfs_client::unlink(inum parent, const char *name) {
    * and update the parent directory content.
    */
 
+  // The file is locked too, so a write to it can't straddle its removal.
+  // Which file that is only shows under the parent's lock: look it up, take
+  // both locks at once (std::lock backs off rather than deadlock with an
+  // unlink taking the same stripes the other way round) and try again if
+  // the name has changed meanwhile.
+  std::unique_lock<std::shared_mutex> lock, file_lock;
+  for (;;) {
+    bool found;
+    inum ino, again;
+    if ((r = lookup(parent, name, found, ino)) != OK) return r;
+    if (!found) return NOENT;
+    lock = std::unique_lock<std::shared_mutex>(ns_lock(parent),
+                                               std::defer_lock);
+    file_lock =
+        std::unique_lock<std::shared_mutex>(ns_lock(ino), std::defer_lock);
+    if (&ns_lock(ino) == &ns_lock(parent))
+      lock.lock();
+    else
+      std::lock(lock, file_lock);
+    if ((r = lookup_nolock(parent, name, found, again)) != OK) return r;
+    if (found && again == ino) break;
+    lock.unlock();
+    if (file_lock) file_lock.unlock();
+  }
   txid_t txid = begin_transaction();
 
-  bool found = false;
-  std::string buf;
-  size_t erase_start, erase_after;
-  inum inum;
-  if ((r = lookup(parent, name, found, inum)) != OK || !found) {
+  extent_protocol::extentid_t inum;
+  if ((r = ec->dir_remove(parent, name, inum)) != OK) {
     printf("unlink empty file!");
+    if (r != NOENT) dcache_drop(parent, name);
     goto commit;
   }
+  dcache_put(parent, name, 0);
 
+  extent_protocol::attr a;
+  if (ec->getattr(inum, a) == OK && a.type == extent_protocol::T_DIR)
+    dcache_drop_dir(inum);
   if ((r = ec->remove(inum)) != OK) {
     goto commit;
   }
-
-  if ((r = ec->get(parent, buf)) != OK) goto commit;
-  erase_start = buf.find(name);
-  erase_after = buf.find('/', buf.find('/', erase_start) + 1);
-  buf.erase(erase_start, erase_after - erase_start + 1);
-
-  if ((r = ec->put(parent, buf)) != OK) goto commit;
+  acache_drop(inum);
 
 commit:
+  acache_drop(parent);
   commit_transaction(txid);
   return r;
 }
@@ -400,13 +570,13 @@ int chfs_client::symlink(inum parent, const char *name, const char *link,
                          inum &ino_out) {
   int r = OK;
 
+  std::unique_lock<std::shared_mutex> lock(ns_lock(parent));
   txid_t txid = begin_transaction();
 
   // check if existed
   bool found = false;
-  std::string buf;
   chfs_client::inum t;
-  if ((r = lookup(parent, name, found, t)) != OK) goto commit;
+  if ((r = lookup_nolock(parent, name, found, t)) != OK) goto commit;
   if (found) {
     commit_transaction(txid);
     return EXIST;
@@ -417,15 +587,42 @@ int chfs_client::symlink(inum parent, const char *name, const char *link,
   if ((r = ec->put(ino_out, std::string(link))) != OK) goto commit;
 
   // add an entry into parent
-  if ((r = ec->get(parent, buf)) != OK) goto commit;
-  buf.append(std::string(name) + "/" + filename(ino_out) + "/");
-  if ((r = ec->put(parent, buf)) != OK) goto commit;
+  if ((r = ec->dir_add(parent, name, ino_out)) != OK) {
+    dcache_drop(parent, name);
+    goto commit;
+  }
+  dcache_put(parent, name, ino_out);
 
 commit:
+  acache_drop(parent);
   commit_transaction(txid);
   return r;
 }
 
+int chfs_client::readdir_plus(inum dir, unsigned long long cursor,
+                              unsigned int max, std::list<direntplus> &list) {
+  int r = OK;
+
+  std::shared_lock<std::shared_mutex> lock(ns_lock(dir));
+  unsigned long epoch = acache_begin();
+  std::vector<extent_protocol::dirent> ents;
+  if ((r = ec->dir_list(dir, cursor, max, ents)) != OK) return r;
+
+  for (auto &x : ents) {
+    direntplus entry;
+    entry.name = x.name;
+    entry.inum = x.inum;
+    entry.cursor = x.cursor;
+    fill_statinfo(x.a, entry.st);
+    list.push_back(entry);
+    // the lookup and getattr of each name are likely next
+    dcache_put(dir, x.name.c_str(), x.inum);
+    acache_put(x.inum, entry.st, epoch);
+  }
+
+  return r;
+}
+
 int chfs_client::readlink(inum ino, std::string &data) {
   int r = OK;
 
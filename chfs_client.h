@@ -1,14 +1,35 @@
 #ifndef chfs_client_h
 #define chfs_client_h
 
+#include <chrono>
+#include <mutex>
+#include <shared_mutex>
 #include <string>
+#include <unordered_map>
 // #include "chfs_protocol.h"
 #include <vector>
 
 #include "extent_client.h"
 
+#define NSLOCKS 64
+// Names cached by lookup
+#define DCACHE_SIZE 4096
+// Attributes fetched ahead by readdir_plus, and how long they are good for
+#define ACACHE_SIZE 4096
+#define ACACHE_TTL std::chrono::seconds(1)
+
 class chfs_client {
   extent_client *ec;
+  // Striped by inum. A directory is held shared by lookup/readdir and
+  // exclusive while an entry is added or removed, so a check-then-add
+  // can't race another create of the same name. A file is held exclusive
+  // by write, setattr and unlink until their transactions commit: the log
+  // is redone in commit order, so two that touch the same file must also
+  // have run in that order.
+  std::shared_mutex ns_locks[NSLOCKS];
+  std::shared_mutex &ns_lock(unsigned long long inum) {
+    return ns_locks[inum % NSLOCKS];
+  }
 
  public:
   typedef unsigned long long inum;
@@ -26,18 +47,72 @@ class chfs_client {
     unsigned long mtime;
     unsigned long ctime;
   };
+  // everything getattr needs, from a single extent call
+  struct statinfo {
+    uint32_t type;  // extent_protocol::types
+    unsigned long long size;
+    unsigned long atime;
+    unsigned long mtime;
+    unsigned long ctime;
+    unsigned long gen;
+  };
   struct dirent {
     std::string name;
     chfs_client::inum inum;
+    unsigned long long cursor;  // resumes readdir right after this entry
+  };
+  struct direntplus {
+    std::string name;
+    chfs_client::inum inum;
+    unsigned long long cursor;
+    statinfo st;
   };
 
  private:
   static std::string filename(inum);
   static inum n2i(std::string);
 
+  // "parent/name" -> inum, or 0 for a name known not to exist. Entries of a
+  // directory are filled and changed under its ns_lock, so they stay exact;
+  // dcache_mtx only protects the map itself.
+  std::mutex dcache_mtx;
+  std::unordered_map<std::string, inum> dcache;
+  static std::string dcache_key(inum parent, const char *name);
+  bool dcache_get(inum parent, const char *name, inum &ino);
+  void dcache_put(inum parent, const char *name, inum ino);
+  void dcache_drop(inum parent, const char *name);
+  // forget every name in dir, before its inum can be reused
+  void dcache_drop_dir(inum dir);
+
+  // Attributes readdir_plus got along with the names, for the stat of each
+  // entry that tends to follow. One is used at most once and for at most
+  // ACACHE_TTL. Every change made here drops the inum it touched once done,
+  // and bumps acache_epoch so a listing that read attributes before the
+  // change doesn't put them back; only atime can go stale, as in the kernel's
+  // own cache.
+  struct prefetched {
+    statinfo st;
+    std::chrono::steady_clock::time_point at;
+  };
+  std::mutex acache_mtx;
+  std::unordered_map<inum, prefetched> acache;
+  unsigned long acache_epoch = 0;
+  unsigned long acache_begin();
+  void acache_put(inum ino, const statinfo &st, unsigned long epoch);
+  bool acache_take(inum ino, statinfo &st);
+  void acache_drop(inum ino);
+
+  // callers hold ns_lock(parent)
+  int lookup_nolock(inum, const char *, bool &, inum &);
+  int readdir_nolock(inum, unsigned long long, unsigned int,
+                     std::list<dirent> &);
+
  public:
   chfs_client();
   chfs_client(std::string, std::string);
+  void set_atime_policy(extent_protocol::atime_policy p) {
+    ec->set_atime_policy(p);
+  }
 
   bool isfile(inum);
   bool isdir(inum);
@@ -45,11 +120,18 @@ class chfs_client {
 
   int getfile(inum, fileinfo &);
   int getdir(inum, dirinfo &);
+  int stat(inum, statinfo &);
 
   int setattr(inum, size_t);
   int lookup(inum, const char *, bool &, inum &);
   int create(inum, const char *, mode_t, inum &);
   int readdir(inum, std::list<dirent> &);
+  // at most max entries, from the cursor of the last one seen (0 to start)
+  int readdir(inum, unsigned long long cursor, unsigned int max,
+              std::list<dirent> &);
+  // the same with each entry's attributes, in one extent call
+  int readdir_plus(inum, unsigned long long cursor, unsigned int max,
+                   std::list<direntplus> &);
   int write(inum, size_t, off_t, const char *, size_t &);
   int read(inum, size_t, off_t, std::string &);
   int unlink(inum, const char *);
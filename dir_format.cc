@@ -0,0 +1,414 @@
+// directory B+tree on top of a dir_store
+
+#include "dir_format.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+static unsigned int page_off(uint32_t p) {
+  return DIR_HDR_SIZE + (p - 1) * DIR_PAGE_SIZE;
+}
+
+static char *leaf_entries(char *page) { return page + sizeof(dir_node); }
+
+static dir_index_rec *index_recs(char *page) {
+  return (dir_index_rec *)(page + sizeof(dir_node));
+}
+
+// Leaf entries aren't aligned, so their fields are copied out.
+static uint32_t entry_hash(const char *e) {
+  uint32_t h;
+  memcpy(&h, e, sizeof(h));
+  return h;
+}
+
+static uint32_t entry_inum(const char *e) {
+  uint32_t inum;
+  memcpy(&inum, e + 4, sizeof(inum));
+  return inum;
+}
+
+static unsigned int entry_name_len(const char *e) {
+  return (unsigned char)e[8];
+}
+
+static unsigned int entry_len(const char *e) {
+  return DIR_ENTRY_HDR + entry_name_len(e);
+}
+
+static std::string make_entry(uint32_t h, uint32_t inum, const char *name,
+                              size_t len) {
+  std::string e(DIR_ENTRY_HDR, '\0');
+  memcpy(&e[0], &h, sizeof(h));
+  memcpy(&e[4], &inum, sizeof(inum));
+  e[8] = (char)len;
+  e.append(name, len);
+  return e;
+}
+
+// FNV-1a
+uint32_t dir_index::hash(const char *name, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)name[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// NOENT if the directory is empty
+int dir_index::load_header() {
+  std::string buf;
+  int r = s->read(0, sizeof(hdr), buf);
+  if (r != extent_protocol::OK) return r;
+  if (buf.size() == 0) return extent_protocol::NOENT;
+  if (buf.size() < sizeof(hdr)) {
+    printf("\tdir: (load_header) directory is truncated\n");
+    return extent_protocol::IOERR;
+  }
+  memcpy(&hdr, buf.data(), sizeof(hdr));
+  if (hdr.magic != DIR_MAGIC || hdr.root == 0 || hdr.root > hdr.npages) {
+    printf("\tdir: (load_header) not a directory index\n");
+    return extent_protocol::IOERR;
+  }
+  return extent_protocol::OK;
+}
+
+int dir_index::write_header() {
+  return s->write(0, std::string((const char *)&hdr, sizeof(hdr)));
+}
+
+int dir_index::read_page(uint32_t p, char *page) {
+  if (p == 0 || p > hdr.npages) {
+    printf("\tdir: (read_page) page %u out of range\n", p);
+    return extent_protocol::IOERR;
+  }
+  std::string buf;
+  int r = s->read(page_off(p), DIR_PAGE_SIZE, buf);
+  if (r != extent_protocol::OK) return r;
+  memset(page, 0, DIR_PAGE_SIZE);
+  memcpy(page, buf.data(), std::min(buf.size(), (size_t)DIR_PAGE_SIZE));
+
+  dir_node *n = (dir_node *)page;
+  if (n->level == 0 ? n->used > DIR_LEAF_SPACE
+                    : n->count == 0 || n->count > DIR_FANOUT) {
+    printf("\tdir: (read_page) page %u is corrupt\n", p);
+    return extent_protocol::IOERR;
+  }
+  return extent_protocol::OK;
+}
+
+int dir_index::write_page(uint32_t p, const char *page) {
+  return s->write(page_off(p), std::string(page, DIR_PAGE_SIZE));
+}
+
+/*
+ * Find name, whose hash is h. On OK the leaf holding it is left in page,
+ * its page number in leaf and the entry's offset among the entries in pos.
+ *
+ * The descent takes the leftmost child that may hold h. bound tracks the
+ * lowest hash the leaves right of the current one can start at, so the
+ * scan only moves on to the next leaf when names hashing to h may have
+ * been split across the boundary.
+ */
+int dir_index::find(const char *name, uint32_t h, uint32_t &leaf, char *page,
+                    unsigned int &pos) {
+  size_t len = strlen(name);
+  uint64_t bound = UINT64_MAX;
+  uint32_t p = hdr.root;
+  int r;
+
+  for (;;) {
+    if ((r = read_page(p, page)) != extent_protocol::OK) return r;
+    dir_node *n = (dir_node *)page;
+    if (n->level == 0) break;
+    dir_index_rec *rec = index_recs(page);
+    uint32_t i = 0;
+    while (i + 1 < n->count && rec[i + 1].hash < h) i++;
+    if (i + 1 < n->count) bound = rec[i + 1].hash;
+    p = rec[i].child;
+  }
+
+  for (;;) {
+    dir_node *n = (dir_node *)page;
+    char *e = leaf_entries(page);
+    for (pos = 0; pos < n->used; pos += entry_len(e + pos)) {
+      uint32_t eh = entry_hash(e + pos);
+      if (eh > h) return extent_protocol::NOENT;
+      if (eh == h && entry_name_len(e + pos) == len &&
+          memcmp(e + pos + DIR_ENTRY_HDR, name, len) == 0) {
+        leaf = p;
+        return extent_protocol::OK;
+      }
+    }
+    if (n->next == 0 || bound != h) return extent_protocol::NOENT;
+    p = n->next;
+    if ((r = read_page(p, page)) != extent_protocol::OK) return r;
+  }
+}
+
+/*
+ * Split the full leaf p, in page, inserting entry e at pos: the entries
+ * past the byte midpoint move to a new leaf linked in right after p, which
+ * is returned in sib.
+ */
+int dir_index::split_leaf(uint32_t p, char *page, unsigned int pos,
+                          const std::string &e, dir_index_rec &sib) {
+  dir_node *n = (dir_node *)page;
+  char *ents = leaf_entries(page);
+  std::string all(ents, pos);
+  all += e;
+  all.append(ents + pos, n->used - pos);
+  unsigned int count = n->count + 1;
+
+  // the entry boundary closest to the middle; there are at least two
+  // entries, so one exists, and both halves then fit in a leaf
+  unsigned int size = all.size(), cut = 0, cut_count = 0;
+  for (unsigned int b = 0, k = 0; b < size;) {
+    b += entry_len(&all[b]);
+    k++;
+    if (b < size &&
+        (cut == 0 || std::max(b, size - b) < std::max(cut, size - cut))) {
+      cut = b;
+      cut_count = k;
+    }
+  }
+
+  char right[DIR_PAGE_SIZE];
+  memset(right, 0, sizeof(right));
+  dir_node *rn = (dir_node *)right;
+  rn->level = 0;
+  rn->count = count - cut_count;
+  rn->used = size - cut;
+  rn->next = n->next;
+  memcpy(leaf_entries(right), all.data() + cut, rn->used);
+
+  sib.hash = entry_hash(&all[cut]);
+  sib.child = ++hdr.npages;
+
+  memset(ents, 0, DIR_LEAF_SPACE);
+  memcpy(ents, all.data(), cut);
+  n->count = cut_count;
+  n->used = cut;
+  n->next = sib.child;
+
+  int r = write_page(sib.child, right);
+  if (r != extent_protocol::OK) return r;
+  return write_page(p, page);
+}
+
+/*
+ * Insert entry e, whose name hashes to h, into the subtree rooted at page
+ * p. If p had to be split, split is set and sib is the record for its new
+ * right sibling, to be added to the parent.
+ */
+int dir_index::insert_node(uint32_t p, uint32_t h, const std::string &e,
+                           bool &split, dir_index_rec &sib) {
+  char page[DIR_PAGE_SIZE];
+  int r = read_page(p, page);
+  if (r != extent_protocol::OK) return r;
+  dir_node *n = (dir_node *)page;
+  split = false;
+
+  if (n->level == 0) {
+    // after the entries with the same hash
+    char *ents = leaf_entries(page);
+    unsigned int pos = 0;
+    while (pos < n->used && entry_hash(ents + pos) <= h)
+      pos += entry_len(ents + pos);
+    if (n->used + e.size() > DIR_LEAF_SPACE) {
+      split = true;
+      return split_leaf(p, page, pos, e, sib);
+    }
+    memmove(ents + pos + e.size(), ents + pos, n->used - pos);
+    memcpy(ents + pos, e.data(), e.size());
+    n->used += e.size();
+    n->count++;
+    return write_page(p, page);
+  }
+
+  dir_index_rec *rec = index_recs(page);
+  uint32_t i = 0;
+  while (i + 1 < n->count && rec[i + 1].hash < h) i++;
+  bool child_split;
+  dir_index_rec child_sib;
+  r = insert_node(rec[i].child, h, e, child_split, child_sib);
+  if (r != extent_protocol::OK || !child_split) return r;
+
+  if (n->count < DIR_FANOUT) {
+    memmove(rec + i + 2, rec + i + 1,
+            (n->count - i - 1) * sizeof(dir_index_rec));
+    rec[i + 1] = child_sib;
+    n->count++;
+    return write_page(p, page);
+  }
+
+  // full: the upper half of the children moves to a new node
+  std::vector<dir_index_rec> all(rec, rec + n->count);
+  all.insert(all.begin() + i + 1, child_sib);
+  uint32_t half = all.size() / 2;
+
+  char right[DIR_PAGE_SIZE];
+  memset(right, 0, sizeof(right));
+  dir_node *rn = (dir_node *)right;
+  rn->level = n->level;
+  rn->count = all.size() - half;
+  memcpy(index_recs(right), &all[half], rn->count * sizeof(dir_index_rec));
+
+  memset(rec, 0, DIR_PAGE_SIZE - sizeof(dir_node));
+  memcpy(rec, all.data(), half * sizeof(dir_index_rec));
+  n->count = half;
+
+  split = true;
+  sib.hash = all[half].hash;
+  sib.child = ++hdr.npages;
+  if ((r = write_page(sib.child, right)) != extent_protocol::OK) return r;
+  return write_page(p, page);
+}
+
+int dir_index::lookup(const char *name, uint32_t &inum) {
+  int r = load_header();
+  if (r != extent_protocol::OK) return r;
+
+  char page[DIR_PAGE_SIZE];
+  uint32_t leaf;
+  unsigned int pos;
+  r = find(name, hash(name, strlen(name)), leaf, page, pos);
+  if (r != extent_protocol::OK) return r;
+  inum = entry_inum(leaf_entries(page) + pos);
+  return extent_protocol::OK;
+}
+
+int dir_index::add(const char *name, uint32_t inum) {
+  size_t len = strlen(name);
+  if (len == 0 || len > DIR_NAME_MAX) {
+    printf("\tdir: (add) bad name length %zu\n", len);
+    return extent_protocol::IOERR;
+  }
+  uint32_t h = hash(name, len);
+  char page[DIR_PAGE_SIZE];
+
+  int r = load_header();
+  if (r == extent_protocol::NOENT) {
+    // the first entry: start with an empty root leaf
+    hdr.magic = DIR_MAGIC;
+    hdr.root = 1;
+    hdr.npages = 1;
+    hdr.depth = 0;
+    memset(page, 0, sizeof(page));
+    if ((r = write_page(1, page)) != extent_protocol::OK) return r;
+    if ((r = write_header()) != extent_protocol::OK) return r;
+  } else if (r != extent_protocol::OK) {
+    return r;
+  } else {
+    uint32_t leaf;
+    unsigned int pos;
+    r = find(name, h, leaf, page, pos);
+    if (r == extent_protocol::OK) return extent_protocol::EXIST;
+    if (r != extent_protocol::NOENT) return r;
+  }
+
+  uint32_t npages = hdr.npages;
+  bool split;
+  dir_index_rec sib;
+  r = insert_node(hdr.root, h, make_entry(h, inum, name, len), split, sib);
+  if (r != extent_protocol::OK) return r;
+  if (split) {
+    // the root split: a new root above the old one and its sibling
+    memset(page, 0, sizeof(page));
+    dir_node *n = (dir_node *)page;
+    n->level = hdr.depth + 1;
+    n->count = 2;
+    index_recs(page)[0].hash = 0;
+    index_recs(page)[0].child = hdr.root;
+    index_recs(page)[1] = sib;
+    hdr.root = ++hdr.npages;
+    hdr.depth++;
+    if ((r = write_page(hdr.root, page)) != extent_protocol::OK) return r;
+  }
+  if (hdr.npages != npages) return write_header();
+  return extent_protocol::OK;
+}
+
+int dir_index::remove(const char *name, uint32_t &inum) {
+  int r = load_header();
+  if (r != extent_protocol::OK) return r;
+
+  char page[DIR_PAGE_SIZE];
+  uint32_t leaf;
+  unsigned int pos;
+  r = find(name, hash(name, strlen(name)), leaf, page, pos);
+  if (r != extent_protocol::OK) return r;
+
+  dir_node *n = (dir_node *)page;
+  char *e = leaf_entries(page) + pos;
+  unsigned int len = entry_len(e);
+  inum = entry_inum(e);
+  memmove(e, e + len, n->used - pos - len);
+  memset(leaf_entries(page) + n->used - len, 0, len);
+  n->used -= len;
+  n->count--;
+  return write_page(leaf, page);
+}
+
+int dir_index::list(std::list<dir_entry> &entries) {
+  return list(0, UINT_MAX, entries);
+}
+
+/*
+ * The descent is the one find makes for the cursor's hash, so the scan
+ * starts at the first leaf that may hold it and skips what was returned
+ * before along the way.
+ */
+int dir_index::list(uint64_t cursor, unsigned int max,
+                    std::list<dir_entry> &entries) {
+  int r = load_header();
+  if (r == extent_protocol::NOENT) return extent_protocol::OK;
+  if (r != extent_protocol::OK) return r;
+
+  uint32_t h = cursor >> DIR_CURSOR_RUN;
+  uint32_t skip = cursor & ((1u << DIR_CURSOR_RUN) - 1);
+  char page[DIR_PAGE_SIZE];
+  uint32_t p = hdr.root;
+  for (;;) {
+    if ((r = read_page(p, page)) != extent_protocol::OK) return r;
+    dir_node *n = (dir_node *)page;
+    if (n->level == 0) break;
+    dir_index_rec *rec = index_recs(page);
+    uint32_t i = 0;
+    while (i + 1 < n->count && rec[i + 1].hash < h) i++;
+    p = rec[i].child;
+  }
+
+  // the hash of the entry before, and how many entries had it
+  uint64_t last = UINT64_MAX;
+  uint32_t nth = 0;
+  unsigned int count = 0;
+  for (uint32_t seen = 0;; seen++) {
+    dir_node *n = (dir_node *)page;
+    char *e = leaf_entries(page);
+    for (unsigned int pos = 0; pos < n->used; pos += entry_len(e + pos)) {
+      uint32_t eh = entry_hash(e + pos);
+      nth = eh == last ? nth + 1 : 1;
+      last = eh;
+      if (eh < h || (eh == h && nth <= skip)) continue;
+      if (count++ == max) return extent_protocol::OK;
+      dir_entry d;
+      d.name.assign(e + pos + DIR_ENTRY_HDR, entry_name_len(e + pos));
+      d.inum = entry_inum(e + pos);
+      d.cursor = DIR_CURSOR(eh, nth);
+      entries.push_back(d);
+    }
+    if (n->next == 0) return extent_protocol::OK;
+    if (seen == hdr.npages) {
+      printf("\tdir: (list) leaf chain loops\n");
+      return extent_protocol::IOERR;
+    }
+    p = n->next;
+    if ((r = read_page(p, page)) != extent_protocol::OK) return r;
+  }
+}
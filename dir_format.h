@@ -0,0 +1,144 @@
+// on-disk directory format
+
+#ifndef dir_format_h
+#define dir_format_h
+
+#include <stdint.h>
+
+#include <list>
+#include <string>
+
+#include "extent_protocol.h"
+
+/*
+ * A directory is a B+tree of entries keyed by the hash of their name.
+ * The first DIR_HDR_SIZE bytes hold a dir_header; after it come the tree
+ * pages, DIR_PAGE_SIZE bytes each and numbered from 1, so page p starts at
+ * DIR_HDR_SIZE + (p - 1) * DIR_PAGE_SIZE. A lookup reads the header and one
+ * page per level instead of the whole directory.
+ *
+ * Leaves hold entries sorted by hash and are chained left to right through
+ * next. Interior nodes hold (hash, child) pairs where child covers the
+ * hashes from its hash up to the next pair's, both ends included: names
+ * with the same hash may end up on either side of a split. Page 1 is the
+ * leftmost leaf for good, since splits always move the upper half out.
+ * Pages are never freed; removing entries can leave leaves empty.
+ *
+ * An empty directory has no contents at all.
+ */
+
+#define DIR_MAGIC 0x44495231
+#define DIR_HDR_SIZE 512
+#define DIR_PAGE_SIZE 1024
+#define DIR_NAME_MAX 255
+
+struct dir_header {
+  uint32_t magic;
+  uint32_t root;    // page of the root node
+  uint32_t npages;  // pages in use
+  uint32_t depth;   // levels above the leaves
+};
+
+// at the start of every page
+struct dir_node {
+  uint16_t level;  // 0 for a leaf
+  uint16_t count;  // entries in a leaf, children in an interior node
+  uint16_t used;   // bytes of entries in a leaf
+  uint16_t unused;
+  uint32_t next;  // next leaf to the right, 0 for the last
+};
+
+// Leaf entries are packed after the dir_node: hash, inum, name length and
+// then the name, with no padding or terminator.
+#define DIR_ENTRY_HDR 9
+#define DIR_LEAF_SPACE (DIR_PAGE_SIZE - sizeof(dir_node))
+
+// interior node record; the hash of the first one is not used
+struct dir_index_rec {
+  uint32_t hash;
+  uint32_t child;
+};
+
+#define DIR_FANOUT ((DIR_PAGE_SIZE - sizeof(dir_node)) / sizeof(dir_index_rec))
+
+static_assert(DIR_LEAF_SPACE >= 2 * (DIR_ENTRY_HDR + DIR_NAME_MAX),
+              "a leaf must hold two entries so it can always be split");
+
+/*
+ * A position in a listing, taken from the hash order so it survives
+ * splits: the hash of the last entry returned, above the low 31 bits,
+ * and how many entries with that hash came back so far, in them. Entries
+ * added or removed meanwhile may or may not show up; other entries are
+ * neither skipped nor repeated, unless one sharing the full hash of the
+ * cursor is removed from before it. The value stays a positive off_t, and
+ * 0 is the start.
+ */
+#define DIR_CURSOR_RUN 31
+#define DIR_CURSOR(h, n) ((uint64_t)(h) << DIR_CURSOR_RUN | (n))
+
+struct dir_entry {
+  std::string name;
+  uint32_t inum;
+  uint64_t cursor;  // resumes the listing right after this entry
+};
+
+// Where the bytes of one directory live. read may come back short at the
+// end of the directory; both return an extent_protocol status.
+class dir_store {
+ public:
+  virtual ~dir_store() {}
+  virtual int read(unsigned int off, unsigned int len, std::string &buf) = 0;
+  virtual int write(unsigned int off, const std::string &buf) = 0;
+};
+
+// A directory image held in a string, as in the dir_index tests.
+class string_dir_store : public dir_store {
+  std::string &d;
+
+ public:
+  string_dir_store(std::string &d) : d(d) {}
+  int read(unsigned int off, unsigned int len, std::string &buf) {
+    buf = off < d.size() ? d.substr(off, len) : "";
+    return extent_protocol::OK;
+  }
+  int write(unsigned int off, const std::string &buf) {
+    if (d.size() < off + buf.size()) d.resize(off + buf.size());
+    d.replace(off, buf.size(), buf);
+    return extent_protocol::OK;
+  }
+};
+
+// Operations on one directory. Callers serialize changes to a directory
+// against each other and against readers.
+class dir_index {
+ private:
+  dir_store *s;
+  dir_header hdr;
+
+  static uint32_t hash(const char *name, size_t len);
+  int load_header();
+  int write_header();
+  int read_page(uint32_t p, char *page);
+  int write_page(uint32_t p, const char *page);
+  int find(const char *name, uint32_t h, uint32_t &leaf, char *page,
+           unsigned int &pos);
+  int insert_node(uint32_t p, uint32_t h, const std::string &e, bool &split,
+                  dir_index_rec &sib);
+  int split_leaf(uint32_t p, char *page, unsigned int pos,
+                 const std::string &e, dir_index_rec &sib);
+
+ public:
+  dir_index(dir_store *s) : s(s) {}
+  // OK and the inum of name, or NOENT
+  int lookup(const char *name, uint32_t &inum);
+  // EXIST if name is already there
+  int add(const char *name, uint32_t inum);
+  // OK and the inum name had, or NOENT
+  int remove(const char *name, uint32_t &inum);
+  // every entry, in hash order
+  int list(std::list<dir_entry> &entries);
+  // at most max entries, picking up at cursor
+  int list(uint64_t cursor, unsigned int max, std::list<dir_entry> &entries);
+};
+
+#endif
@@ -46,6 +46,24 @@ extent_client::put(extent_protocol::extentid_t eid, std::string buf)
   return ret;
 }
 
+extent_protocol::status
+extent_client::read(extent_protocol::extentid_t eid, unsigned int off,
+		    unsigned int len, std::string &buf)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  ret = es->read(eid, off, len, buf);
+  return ret;
+}
+
+extent_protocol::status
+extent_client::write(extent_protocol::extentid_t eid, unsigned int off,
+		     std::string buf, int &written)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  ret = es->write(eid, off, buf, written);
+  return ret;
+}
+
 extent_protocol::status
 extent_client::remove(extent_protocol::extentid_t eid)
 {
@@ -55,4 +73,31 @@ extent_client::remove(extent_protocol::extentid_t eid)
   return ret;
 }
 
+extent_protocol::status
+extent_client::dir_add(extent_protocol::extentid_t parent, std::string name,
+		       extent_protocol::extentid_t inum)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  int r;
+  ret = es->dir_add(parent, name, inum, r);
+  return ret;
+}
+
+extent_protocol::status
+extent_client::dir_remove(extent_protocol::extentid_t parent,
+			  std::string name, extent_protocol::extentid_t &inum)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  ret = es->dir_remove(parent, name, inum);
+  return ret;
+}
 
+extent_protocol::status
+extent_client::dir_list(extent_protocol::extentid_t dir,
+			unsigned long long cursor, unsigned int max,
+			std::vector<extent_protocol::dirent> &ents)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  ret = es->dir_list(dir, cursor, max, ents);
+  return ret;
+}
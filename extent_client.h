@@ -22,10 +22,28 @@ class extent_client {
   extent_protocol::status getattr(extent_protocol::extentid_t eid,
                                   extent_protocol::attr &a);
   extent_protocol::status put(extent_protocol::extentid_t eid, std::string buf);
+  extent_protocol::status read(extent_protocol::extentid_t eid,
+                               unsigned int off, unsigned int len,
+                               std::string &buf);
+  extent_protocol::status write(extent_protocol::extentid_t eid,
+                                unsigned int off, std::string buf,
+                                int &written);
   extent_protocol::status remove(extent_protocol::extentid_t eid);
-
-  txid_t get_next_txid() { return es->txid_manager.get_next_txid(); }
-  void append_log(chfs_command_ptr cmd) { es->append_log(cmd); }
+  extent_protocol::status dir_add(extent_protocol::extentid_t parent,
+                                  std::string name,
+                                  extent_protocol::extentid_t inum);
+  extent_protocol::status dir_remove(extent_protocol::extentid_t parent,
+                                     std::string name,
+                                     extent_protocol::extentid_t &inum);
+  extent_protocol::status dir_list(extent_protocol::extentid_t dir,
+                                   unsigned long long cursor, unsigned int max,
+                                   std::vector<extent_protocol::dirent> &ents);
+
+  void set_atime_policy(extent_protocol::atime_policy p) {
+    es->set_atime_policy(p);
+  }
+  txid_t begin_tx() { return es->begin_tx(); }
+  void commit_tx(txid_t txid) { es->commit_tx(txid); }
 };
 
 #endif
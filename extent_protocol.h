@@ -15,14 +15,20 @@ public:
     OK,
     RPCERR,
     NOENT,
-    IOERR
+    IOERR,
+    EXIST
   };
   enum rpc_numbers
   {
     put = 0x6001,
     get,
     getattr,
-    remove
+    remove,
+    read,
+    write,
+    dir_add,
+    dir_remove,
+    dir_list
   };
 
   enum types
@@ -32,6 +38,14 @@ public:
     T_SYMBOLIC_LINK
   };
 
+  // when a read updates atime, as in the mount options of the same names
+  enum atime_policy
+  {
+    ATIME_STRICT,   // on every read
+    ATIME_RELATIME, // if older than mtime or ctime, or a day old
+    ATIME_NOATIME   // never
+  };
+
   struct attr
   {
     uint32_t type;
@@ -39,6 +53,16 @@ public:
     unsigned int mtime;
     unsigned int ctime;
     unsigned int size;
+    unsigned int gen; // tells apart successive files with the same inum
+  };
+
+  // one directory entry with the attributes of the file it names
+  struct dirent
+  {
+    std::string name;
+    extentid_t inum;
+    unsigned long long cursor; // resumes dir_list right after this entry
+    attr a;
   };
 };
 
@@ -50,6 +74,7 @@ operator>>(unmarshall &u, extent_protocol::attr &a)
   u >> a.mtime;
   u >> a.ctime;
   u >> a.size;
+  u >> a.gen;
   return u;
 }
 
@@ -61,6 +86,27 @@ operator<<(marshall &m, extent_protocol::attr a)
   m << a.mtime;
   m << a.ctime;
   m << a.size;
+  m << a.gen;
+  return m;
+}
+
+inline unmarshall &
+operator>>(unmarshall &u, extent_protocol::dirent &e)
+{
+  u >> e.name;
+  u >> e.inum;
+  u >> e.cursor;
+  u >> e.a;
+  return u;
+}
+
+inline marshall &
+operator<<(marshall &m, extent_protocol::dirent e)
+{
+  m << e.name;
+  m << e.inum;
+  m << e.cursor;
+  m << e.a;
   return m;
 }
 
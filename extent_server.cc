@@ -9,38 +9,98 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <sstream>
 
+#include "dir_format.h"
 #include "persister.h"
 
+// A directory read and written in place in the inode layer.
+class im_dir_store : public dir_store {
+  inode_manager *im;
+  uint32_t inum;
+
+ public:
+  im_dir_store(inode_manager *im, uint32_t inum) : im(im), inum(inum) {}
+  int read(unsigned int off, unsigned int len, std::string &buf) {
+    buf.resize(len);
+    int n = im->read_range(inum, off, len, &buf[0]);
+    if (n < 0) return extent_protocol::IOERR;
+    buf.resize(n);
+    return extent_protocol::OK;
+  }
+  int write(unsigned int off, const std::string &buf) {
+    int n = im->write_range(inum, off, buf.data(), buf.size());
+    if (n != (int)buf.size()) return extent_protocol::IOERR;
+    return extent_protocol::OK;
+  }
+};
+
 extent_server::extent_server() {
-  im = new inode_manager();
+  im = new inode_manager("log/disk.img");
   _persister = new chfs_persister("log");  // DO NOT change the dir name here
 
   // Your code here for Lab2A: recover data on startup
-  _persister->restore_checkpoint();
-  // 从checkpoint_entries 复原state
-  printf("redo begin\n");
-  chfs_command_create *log_create = nullptr;
-  chfs_command_put *log_put = nullptr;
-  for (int i = 1; i <= INODE_NUM; i++) {
-    if ((log_create = _persister->checkpoint_create[i]) != nullptr) {
-      // create
+  // Even after a crash the image is just as the last sync left it, at
+  // mounted_txid(); only what the log has committed since is redone on top,
+  // and stays in the log until the next sync. A freshly formatted image
+  // starts a new file system, and the log of the old one has nothing to
+  // apply to.
+  if (im->mounted()) {
+    printf("redo on disk image at txid %llu\n",
+           (unsigned long long)im->mounted_txid());
+    _persister->restore_logdata(im->mounted_txid(),
+                                [this](chfs_command *log) { redo(log); });
+  } else {
+    _persister->clear_log();
+  }
+  // new txids must come after everything in the log and the image
+  txid_manager.set_txid(
+      std::max(_persister->last_txid, (txid_t)im->mounted_txid()));
+}
+
+// Redo one record of a committed transaction. There is no transaction open,
+// so nothing is logged again.
+void extent_server::redo(chfs_command *log) {
+  int r = 0;
+  switch (log->cmdTy) {
+    case CMD_CREATE: {
+      auto p = dynamic_cast<chfs_command_create *>(log);
       extent_protocol::extentid_t inum = 0;
-      assert(log_create->inum != (uint32_t)1);
-      assert(log_create->inum == (uint32_t)i);
-      create(log_create->type, inum, log_create->inum);
-      assert((uint32_t)inum == log_create->inum);
+      create(p->type, inum, p->inum);
+      assert((uint32_t)inum == p->inum);
+      break;
+    }
+    case CMD_PUT: {
+      auto p = dynamic_cast<chfs_command_put *>(log);
+      put(p->inum, p->str, r);
+      break;
     }
-    if ((log_put = _persister->checkpoint_put[i]) != nullptr) {
-      // put
-      printf("redo put inum=%d\n", log_put->inum);
-      int r = 0;
-      put(log_put->inum, log_put->str, r);
+    case CMD_WRITE: {
+      auto p = dynamic_cast<chfs_command_write *>(log);
+      write(p->inum, p->off, p->str, r);
+      break;
     }
+    case CMD_REMOVE: {
+      auto p = dynamic_cast<chfs_command_remove *>(log);
+      remove(p->inum, r);
+      break;
+    }
+    case CMD_DIR_ADD: {
+      auto p = dynamic_cast<chfs_command_dir_add *>(log);
+      dir_add(p->parent, p->name, p->inum, r);
+      break;
+    }
+    case CMD_DIR_REMOVE: {
+      auto p = dynamic_cast<chfs_command_dir_remove *>(log);
+      extent_protocol::extentid_t inum;
+      dir_remove(p->parent, p->name, inum);
+      break;
+    }
+    default:
+      // BEGIN and COMMIT
+      break;
   }
-  _persister->log_entries.clear();
-  printf("redo end\n");
 }
 
 int extent_server::create(uint32_t type, extent_protocol::extentid_t &id,
@@ -50,10 +110,12 @@ int extent_server::create(uint32_t type, extent_protocol::extentid_t &id,
   // printf("[in create] %u\n", type);
   id = im->alloc_inode(type, pos);
   printf("in [create] alloc id=%llu pos=%u\n", id, pos);
+  // no inode to log a create of
+  if (id == 0) return extent_protocol::IOERR;
 
   // Lab2A: add create log into persist
   // append log
-  txid_t txid = txid_manager.get_txid();
+  txid_t txid = txid_manager.get_current();
   chfs_command_ptr cmd_ptr = new chfs_command_create(txid, type, id);
   append_log(cmd_ptr);
 
@@ -69,7 +131,7 @@ int extent_server::put(extent_protocol::extentid_t id, std::string buf, int &) {
   im->write_file(id, cbuf, size);
   // Lab2A: add create log into persist
   // append log
-  txid_t txid = txid_manager.get_txid();
+  txid_t txid = txid_manager.get_current();
   chfs_command *cmd_ptr = new chfs_command_put(txid, id, size, buf);
   append_log(cmd_ptr);
 
@@ -95,6 +157,51 @@ int extent_server::get(extent_protocol::extentid_t id, std::string &buf) {
   return extent_protocol::OK;
 }
 
+// Read up to len bytes at offset off; short at EOF.
+int extent_server::read(extent_protocol::extentid_t id, unsigned int off,
+                        unsigned int len, std::string &buf) {
+  printf("extent_server: read %lld off=%u len=%u\n", id, off, len);
+
+  id &= 0x7fffffff;
+
+  extent_protocol::attr a;
+  memset(&a, 0, sizeof(a));
+  im->get_attr(id, a);
+  if (a.type == 0) return extent_protocol::NOENT;
+  if (off >= a.size) {
+    buf = "";
+    return extent_protocol::OK;
+  }
+  buf.resize(std::min(len, a.size - off));
+  int n = im->read_range(id, off, buf.size(), &buf[0]);
+  if (n < 0) return extent_protocol::IOERR;
+  buf.resize(n);
+
+  return extent_protocol::OK;
+}
+
+// Write buf at offset off, extending the file if needed. Sets written to the
+// number of bytes written, which is short only if the disk is full.
+int extent_server::write(extent_protocol::extentid_t id, unsigned int off,
+                         std::string buf, int &written) {
+  printf("extent_server: write %lld off=%u size=%lu\n", id, off, buf.size());
+
+  id &= 0x7fffffff;
+
+  written = im->write_range(id, off, buf.data(), buf.size());
+  if (written < 0) return extent_protocol::IOERR;
+  if (written == 0) return extent_protocol::OK;
+
+  // Lab2A: add create log into persist
+  // append log
+  txid_t txid = txid_manager.get_current();
+  chfs_command *cmd_ptr =
+      new chfs_command_write(txid, id, off, buf.substr(0, written));
+  append_log(cmd_ptr);
+
+  return extent_protocol::OK;
+}
+
 int extent_server::getattr(extent_protocol::extentid_t id,
                            extent_protocol::attr &a) {
   printf("extent_server: getattr %lld\n", id);
@@ -118,9 +225,96 @@ int extent_server::remove(extent_protocol::extentid_t id, int &) {
 
   // Lab2A: add create log into persist
   // append log
-  txid_t txid = txid_manager.get_txid();
+  txid_t txid = txid_manager.get_current();
+  if (txid == 0) {
+    im->recycle_inode(id);
+  } else {
+    std::lock_guard<std::mutex> lock(tx_mtx);
+    freed_inums[txid].push_back(id);
+  }
   chfs_command *cmd_ptr = new chfs_command_remove(txid, id);
   append_log(cmd_ptr);
 
   return extent_protocol::OK;
 }
+
+// Add name -> inum to directory parent. Only the directory pages on the
+// way to the entry are rewritten, and only the entry itself is logged.
+int extent_server::dir_add(extent_protocol::extentid_t parent,
+                           std::string name, extent_protocol::extentid_t inum,
+                           int &) {
+  printf("extent_server: dir_add %lld %s -> %lld\n", parent, name.c_str(),
+         inum);
+
+  parent &= 0x7fffffff;
+
+  std::lock_guard<std::mutex> lock(dir_locks[parent % ILOCKS]);
+  im_dir_store ds(im, parent);
+  int r = dir_index(&ds).add(name.c_str(), inum);
+  if (r != extent_protocol::OK) return r;
+
+  txid_t txid = txid_manager.get_current();
+  chfs_command *cmd_ptr = new chfs_command_dir_add(txid, parent, name, inum);
+  append_log(cmd_ptr);
+
+  return extent_protocol::OK;
+}
+
+// Remove name from directory parent, setting inum to what it named.
+int extent_server::dir_remove(extent_protocol::extentid_t parent,
+                              std::string name,
+                              extent_protocol::extentid_t &inum) {
+  printf("extent_server: dir_remove %lld %s\n", parent, name.c_str());
+
+  parent &= 0x7fffffff;
+
+  std::lock_guard<std::mutex> lock(dir_locks[parent % ILOCKS]);
+  im_dir_store ds(im, parent);
+  uint32_t removed;
+  int r = dir_index(&ds).remove(name.c_str(), removed);
+  if (r != extent_protocol::OK) return r;
+  inum = removed;
+
+  txid_t txid = txid_manager.get_current();
+  chfs_command *cmd_ptr = new chfs_command_dir_remove(txid, parent, name);
+  append_log(cmd_ptr);
+
+  return extent_protocol::OK;
+}
+
+// Up to max entries of directory dir from cursor on, each with the
+// attributes of the file it names, so a listing that wants them needs no
+// getattr per entry. NOENT if dir isn't a directory.
+int extent_server::dir_list(extent_protocol::extentid_t dir,
+                            unsigned long long cursor, unsigned int max,
+                            std::vector<extent_protocol::dirent> &ents) {
+  printf("extent_server: dir_list %lld from %llx\n", dir, cursor);
+
+  dir &= 0x7fffffff;
+
+  extent_protocol::attr a;
+  memset(&a, 0, sizeof(a));
+  im->get_attr(dir, a);
+  if (a.type != extent_protocol::T_DIR) return extent_protocol::NOENT;
+
+  // the pages are read one at a time; keep dir_add and dir_remove out
+  std::lock_guard<std::mutex> lock(dir_locks[dir % ILOCKS]);
+  im_dir_store ds(im, dir);
+  std::list<dir_entry> entries;
+  int r = dir_index(&ds).list(cursor, max, entries);
+  if (r != extent_protocol::OK) return r;
+
+  ents.clear();
+  ents.reserve(entries.size());
+  for (auto &x : entries) {
+    extent_protocol::dirent e;
+    e.name = x.name;
+    e.inum = x.inum;
+    e.cursor = x.cursor;
+    memset(&e.a, 0, sizeof(e.a));
+    im->get_attr(x.inum, e.a);
+    ents.push_back(e);
+  }
+
+  return extent_protocol::OK;
+}
@@ -30,6 +30,11 @@ main(int argc, char *argv[])
   server.reg(extent_protocol::getattr, &ls, &extent_server::getattr);
   server.reg(extent_protocol::put, &ls, &extent_server::put);
   server.reg(extent_protocol::remove, &ls, &extent_server::remove);
+  server.reg(extent_protocol::read, &ls, &extent_server::read);
+  server.reg(extent_protocol::write, &ls, &extent_server::write);
+  server.reg(extent_protocol::dir_add, &ls, &extent_server::dir_add);
+  server.reg(extent_protocol::dir_remove, &ls, &extent_server::dir_remove);
+  server.reg(extent_protocol::dir_list, &ls, &extent_server::dir_list);
 
   while(1)
     sleep(1000);
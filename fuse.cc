@@ -16,10 +16,14 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include "lang/verify.h"
+#include "thr_pool.h"
 #include "chfs_client.h"
 
 int myid;
 chfs_client *chfs;
+// seconds the kernel may cache attributes and names for
+double attr_timeout = 1.0;
+double entry_timeout = 1.0;
 
 int id()
 {
@@ -39,59 +43,63 @@ int id()
 // (atime, mtime, and ctime), and correct values for file sizes.
 //
 chfs_client::status
-getattr(chfs_client::inum inum, struct stat &st)
+getattr(chfs_client::inum inum, struct stat &st, unsigned long *gen = NULL)
 {
     chfs_client::status ret;
+    chfs_client::statinfo info;
 
     bzero(&st, sizeof(st));
 
     st.st_ino = inum;
-    printf("getattr %016llx %d\n", inum, chfs->isfile(inum));
-    if (chfs->isfile(inum))
+    // one extent call gives the type along with the rest
+    ret = chfs->stat(inum, info);
+    if (ret != chfs_client::OK)
+        return ret;
+    printf("getattr %016llx %u\n", inum, info.type);
+    switch (info.type)
     {
-        chfs_client::fileinfo info;
-        ret = chfs->getfile(inum, info);
-        if (ret != chfs_client::OK)
-            return ret;
+    case extent_protocol::T_FILE:
         st.st_mode = S_IFREG | 0666;
         st.st_nlink = 1;
-        st.st_atime = info.atime;
-        st.st_mtime = info.mtime;
-        st.st_ctime = info.ctime;
         st.st_size = info.size;
-        printf("   getattr -> %llu\n", info.size);
-    }
-    else if (chfs->isdir(inum))
-    {
-        chfs_client::dirinfo info;
-        ret = chfs->getdir(inum, info);
-        if (ret != chfs_client::OK)
-            return ret;
+        break;
+    case extent_protocol::T_DIR:
         st.st_mode = S_IFDIR | 0777;
         st.st_nlink = 2;
-        st.st_atime = info.atime;
-        st.st_mtime = info.mtime;
-        st.st_ctime = info.ctime;
-        printf("   getattr -> %lu %lu %lu\n", info.atime, info.mtime, info.ctime);
-    }
-    else if (chfs->issymbolic(inum))
-    {
-        // is symbolic link the same as regular file?
-        chfs_client::fileinfo info;
-        ret = chfs->getfile(inum, info);
-        if (ret != chfs_client::OK)
-            return ret;
+        break;
+    case extent_protocol::T_SYMBOLIC_LINK:
         st.st_mode = S_IFLNK | 0777;
         st.st_nlink = 1;
-        st.st_atime = info.atime;
-        st.st_mtime = info.mtime;
-        st.st_ctime = info.ctime;
         st.st_size = info.size;
-        printf("   getattr -> sybolic link %llu\n", info.size);
+        break;
+    default:
+        return chfs_client::NOENT;
     }
+    st.st_atime = info.atime;
+    st.st_mtime = info.mtime;
+    st.st_ctime = info.ctime;
+    if (gen)
+        *gen = info.gen;
+    printf("   getattr -> %llu %lu %lu %lu\n", info.size, info.atime,
+           info.mtime, info.ctime);
     return chfs_client::OK;
 }
 
+//
+// Fill in @e for inum: its attributes and generation, and how long the
+// kernel may cache them and the name that led to it. The generation
+// changes whenever an inum is reused, so the kernel never mistakes a new
+// file for one it cached before.
+//
+chfs_client::status
+getentry(chfs_client::inum inum, struct fuse_entry_param &e)
+{
+    e.ino = inum;
+    e.attr_timeout = attr_timeout;
+    e.entry_timeout = entry_timeout;
+    return getattr(inum, e.attr, &e.generation);
+}
+
 //
 // This is a typical fuse operation handler; you'll be writing
 // a bunch of handlers like it.
@@ -120,7 +128,7 @@ void fuseserver_getattr(fuse_req_t req, fuse_ino_t ino,
         fuse_reply_err(req, ENOENT);
         return;
     }
-    fuse_reply_attr(req, &st, 0);
+    fuse_reply_attr(req, &st, attr_timeout);
 }
 
 //
@@ -158,7 +166,7 @@ void fuseserver_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
         }
 
         getattr(inum, st);
-        fuse_reply_attr(req, &st, 0);
+        fuse_reply_attr(req, &st, attr_timeout);
 
 #else
         fuse_reply_err(req, ENOSYS);
@@ -250,10 +258,6 @@ fuseserver_createhelper(fuse_ino_t parent, const char *name,
                         mode_t mode, struct fuse_entry_param *e, int type)
 {
     int ret;
-    // In chfs, timeouts are always set to 0.0, and generations are always set to 0
-    e->attr_timeout = 0.0;
-    e->entry_timeout = 0.0;
-    e->generation = 0;
 
     chfs_client::inum inum;
     if (type == extent_protocol::T_FILE)
@@ -262,9 +266,7 @@ fuseserver_createhelper(fuse_ino_t parent, const char *name,
         ret = chfs->mkdir(parent, name, mode, inum);
     if (ret != chfs_client::OK)
         return ret;
-    e->ino = inum;
-    ret = getattr(inum, e->attr);
-    return ret;
+    return getentry(inum, *e);
 }
 
 void fuseserver_create(fuse_req_t req, fuse_ino_t parent, const char *name,
@@ -320,19 +322,13 @@ void fuseserver_mknod(fuse_req_t req, fuse_ino_t parent,
 void fuseserver_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
     struct fuse_entry_param e;
-    // In chfs, timeouts are always set to 0.0, and generations are always set to 0
-    e.attr_timeout = 0.0;
-    e.entry_timeout = 0.0;
-    e.generation = 0;
     bool found = false;
 
     chfs_client::inum ino;
     chfs->lookup(parent, name, found, ino);
 
-    if (found)
+    if (found && getentry(ino, e) == chfs_client::OK)
     {
-        e.ino = ino;
-        getattr(ino, e.attr);
         fuse_reply_entry(req, &e);
     }
     else
@@ -341,68 +337,65 @@ void fuseserver_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
     }
 }
 
-struct dirbuf
-{
-    char *p;
-    size_t size;
-};
-
-void dirbuf_add(struct dirbuf *b, const char *name, fuse_ino_t ino)
-{
-    struct stat stbuf;
-    size_t oldsize = b->size;
-    b->size += fuse_dirent_size(strlen(name));
-    b->p = (char *)realloc(b->p, b->size);
-    memset(&stbuf, 0, sizeof(stbuf));
-    stbuf.st_ino = ino;
-    fuse_add_dirent(b->p + oldsize, name, &stbuf, b->size);
-}
-
-#define min(x, y) ((x) < (y) ? (x) : (y))
-
-int reply_buf_limited(fuse_req_t req, const char *buf, size_t bufsize,
-                      off_t off, size_t maxsize)
-{
-    if ((size_t)off < bufsize)
-        return fuse_reply_buf(req, buf + off, min(bufsize - off, maxsize));
-    else
-        return fuse_reply_buf(req, NULL, 0);
-}
-
 //
-// Retrieve all the file names / i-numbers pairs
-// in directory @ino. Send the reply using reply_buf_limited.
+// Retrieve the file names / i-numbers pairs in directory @ino
+// that follow @off, as many as fit in @size bytes.
 //
-// You can ignore @size and @off (except that you must pass
-// them to reply_buf_limited).
+// @off is 0 or the offset of an entry a previous call returned.
+// Each entry's offset is the directory cursor just past it, so a
+// listing picks up where the last reply stopped rather than
+// rebuilding the whole directory, and each call only reads about
+// @size bytes worth of entries.
 //
-// Call dirbuf_add(&b, name, inum) for each entry in the directory.
+// The entries come with their attributes in the same call, which
+// chfs keeps for the lookups and getattrs "ls -l" sends next, and
+// which give each entry its d_type.
 //
 void fuseserver_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
                         off_t off, struct fuse_file_info *fi)
 {
     chfs_client::inum inum = ino; // req->in.h.nodeid;
-    struct dirbuf b;
+    int ret;
 
     printf("fuseserver_readdir\n");
 
-    if (!chfs->isdir(inum))
+    // no entry takes less than fuse_dirent_size(1) bytes
+    std::list<chfs_client::direntplus> entries;
+    ret = chfs->readdir_plus(inum, off, size / fuse_dirent_size(1), entries);
+    if (ret != chfs_client::OK)
     {
-        fuse_reply_err(req, ENOTDIR);
+        fuse_reply_err(req, ret == chfs_client::NOENT ? ENOTDIR : EIO);
         return;
     }
 
-    memset(&b, 0, sizeof(b));
-
-    std::list<chfs_client::dirent> entries;
-    chfs->readdir(inum, entries);
-    for (std::list<chfs_client::dirent>::iterator it = entries.begin(); it != entries.end(); ++it)
+    char *buf = (char *)malloc(size);
+    char *p = buf;
+    struct stat stbuf;
+    memset(&stbuf, 0, sizeof(stbuf));
+    for (std::list<chfs_client::direntplus>::iterator it = entries.begin(); it != entries.end(); ++it)
     {
-        dirbuf_add(&b, it->name.c_str(), (fuse_ino_t)it->inum);
+        if ((size_t)(p - buf) + fuse_dirent_size(it->name.size()) > size)
+            break;
+        stbuf.st_ino = it->inum;
+        switch (it->st.type)
+        {
+        case extent_protocol::T_FILE:
+            stbuf.st_mode = S_IFREG;
+            break;
+        case extent_protocol::T_DIR:
+            stbuf.st_mode = S_IFDIR;
+            break;
+        case extent_protocol::T_SYMBOLIC_LINK:
+            stbuf.st_mode = S_IFLNK;
+            break;
+        default:
+            stbuf.st_mode = 0;
+        }
+        p = fuse_add_dirent(p, it->name.c_str(), &stbuf, it->cursor);
     }
 
-    reply_buf_limited(req, b.p, b.size, off, size);
-    free(b.p);
+    fuse_reply_buf(req, buf, p - buf);
+    free(buf);
 }
 
 void fuseserver_open(fuse_req_t req, fuse_ino_t ino,
@@ -425,10 +418,6 @@ void fuseserver_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
                       mode_t mode)
 {
     struct fuse_entry_param e;
-    // In chfs, timeouts are always set to 0.0, and generations are always set to 0
-    e.attr_timeout = 0.0;
-    e.entry_timeout = 0.0;
-    e.generation = 0;
     // Suppress compiler warning of unused e.
     // (void)e;
 
@@ -515,12 +504,7 @@ void fuseserver_symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
     chfs_client::status stat;
     struct fuse_entry_param e;
 
-    e.attr_timeout = 0.0;
-    e.entry_timeout = 0.0;
-    e.generation = 0;
-
     stat = chfs->symlink(parent, name, link, ino);
-    e.ino = ino;
     if (stat != chfs_client::OK)
     {
         if (stat == chfs_client::EXIST)
@@ -530,7 +514,7 @@ void fuseserver_symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
         return;
     }
 
-    if (getattr(ino, e.attr) != chfs_client::OK)
+    if (getentry(ino, e) != chfs_client::OK)
     {
         fuse_reply_err(req, ENOENT);
         return;
@@ -563,6 +547,69 @@ void fuseserver_readlink(fuse_req_t req, fuse_ino_t ino)
 
 struct fuse_lowlevel_ops fuseserver_oper;
 
+//
+// Serve the session from a pool of @nthreads workers. Each one runs
+// the same receive/process loop as fuse_session_loop() on the shared
+// channel, so the kernel hands every request to whichever worker is
+// idle and a long write no longer holds up getattr on other files.
+// chfs_client and the layers below do their own locking.
+//
+class fuse_dispatcher
+{
+public:
+    fuse_dispatcher(struct fuse_session *se, struct fuse_chan *ch)
+        : se(se), ch(ch), err(0) {}
+    int run(int nthreads);
+    void worker(int id);
+
+private:
+    struct fuse_session *se;
+    struct fuse_chan *ch;
+    int err;
+};
+
+void fuse_dispatcher::worker(int id)
+{
+    size_t bufsize = fuse_chan_bufsize(ch);
+    char *buf = (char *)malloc(bufsize);
+    if (buf == NULL)
+    {
+        fprintf(stderr, "fuse worker %d: cannot allocate buffer\n", id);
+        __atomic_store_n(&err, -1, __ATOMIC_RELAXED);
+        fuse_session_exit(se);
+        return;
+    }
+
+    while (!fuse_session_exited(se))
+    {
+        struct fuse_chan *tmpch = ch;
+        int res = fuse_chan_recv(&tmpch, buf, bufsize);
+        if (res == -EINTR)
+            continue;
+        if (res <= 0)
+        {
+            if (res < 0)
+                __atomic_store_n(&err, -1, __ATOMIC_RELAXED);
+            break;
+        }
+        fuse_session_process(se, buf, res, tmpch);
+    }
+    free(buf);
+    // wake the others up as well; on unmount they all see ENODEV anyway
+    fuse_session_exit(se);
+}
+
+int fuse_dispatcher::run(int nthreads)
+{
+    // the pool's destructor joins the workers once the session ends
+    ThrPool *pool = new ThrPool(nthreads - 1);
+    for (int i = 1; i < nthreads; i++)
+        pool->addObjJob(this, &fuse_dispatcher::worker, i);
+    worker(0);
+    delete pool;
+    return err;
+}
+
 int main(int argc, char *argv[])
 {
     char *mountpoint = 0;
@@ -577,12 +624,50 @@ int main(int argc, char *argv[])
         exit(1);
     }
 #endif
-    if (argc != 2)
+    // -o strictatime|relatime|noatime picks when reads update atime
+    extent_protocol::atime_policy atime = extent_protocol::ATIME_RELATIME;
+    // -o threads=N sets the number of FUSE workers, one per core by default
+    // -o attr_timeout=S,entry_timeout=S set how long the kernel may cache
+    // attributes and names, 0 to ask every time
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+        {
+            const char *opt = argv[++i];
+            if (strcmp(opt, "strictatime") == 0)
+                atime = extent_protocol::ATIME_STRICT;
+            else if (strcmp(opt, "relatime") == 0)
+                atime = extent_protocol::ATIME_RELATIME;
+            else if (strcmp(opt, "noatime") == 0)
+                atime = extent_protocol::ATIME_NOATIME;
+            else if (strncmp(opt, "threads=", 8) == 0 && atoi(opt + 8) > 0)
+                nthreads = atoi(opt + 8);
+            else if (strncmp(opt, "attr_timeout=", 13) == 0)
+                attr_timeout = atof(opt + 13);
+            else if (strncmp(opt, "entry_timeout=", 14) == 0)
+                entry_timeout = atof(opt + 14);
+            else
+            {
+                fprintf(stderr, "unknown option %s\n", opt);
+                exit(1);
+            }
+        }
+        else if (mountpoint == 0)
+            mountpoint = argv[i];
+        else
+        {
+            mountpoint = 0;
+            break;
+        }
+    }
+    if (mountpoint == 0)
     {
-        fprintf(stderr, "Usage: chfs_client <mountpoint>\n");
+        fprintf(stderr, "Usage: chfs_client [-o strictatime|relatime|noatime]"
+                        " [-o threads=N] [-o attr_timeout=S]"
+                        " [-o entry_timeout=S] <mountpoint>\n");
         exit(1);
     }
-    mountpoint = argv[1];
 
     srandom(getpid());
 
@@ -590,6 +675,7 @@ int main(int argc, char *argv[])
 
     // chfs = new chfs_client(argv[2], argv[3]);
     chfs = new chfs_client();
+    chfs->set_atime_policy(atime);
 
     fuseserver_oper.getattr = fuseserver_getattr;
     fuseserver_oper.statfs = fuseserver_statfs;
@@ -666,8 +752,13 @@ int main(int argc, char *argv[])
     }
 
     fuse_session_add_chan(se, ch);
-    // err = fuse_session_loop_mt(se);   // FK: wheelfs does this; why?
-    err = fuse_session_loop(se);
+    if (nthreads > 1)
+    {
+        fuse_dispatcher d(se, ch);
+        err = d.run(nthreads);
+    }
+    else
+        err = fuse_session_loop(se);
 
     fuse_session_destroy(se);
     close(fd);
@@ -45,4 +45,15 @@ test_if_has_mount
 
 # finally reaches here!
 echo ""
-echo "Part3 score: "$score"/20"
\ No newline at end of file
+echo "Part3 score: "$score"/20"
+
+##################################################
+
+# run the crash test
+./test-lab2a-part4.sh | grep -q "Passed CRASH"
+if [ $? -ne 0 ];
+then
+        echo "Failed CRASH test"
+else
+        echo "Passed CRASH test"
+fi
@@ -1,10 +1,42 @@
 #include "inode_manager.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
 // disk layer -----------------------------------------
 
-disk::disk() {
-  bzero(blocks, sizeof(blocks));
+disk::disk(const char *image) : blocks(NULL), fd(-1) {
+  void *p = MAP_FAILED;
+  if (image != NULL && (fd = open(image, O_RDWR | O_CREAT, 0644)) >= 0) {
+    // reserve the whole image up front, so a store through the mapping can
+    // never fault on a full file system
+    if (posix_fallocate(fd, 0, DISK_SIZE) == 0)
+      p = mmap(NULL, DISK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  if (p == MAP_FAILED) {
+    if (image != NULL)
+      printf("\tdisk: can't map image %s, using memory instead\n", image);
+    p = mmap(NULL, DISK_SIZE, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(p != MAP_FAILED);
+  }
+  blocks = (unsigned char(*)[BLOCK_SIZE])p;
   // printf("size of inode_t: %ld\n", sizeof(inode_t)); //424
+  if (fd >= 0) {
+    journal = std::string(image) + ".journal";
+    replay_journal();
+  }
+}
+
+disk::~disk() {
+  sync();
+  munmap(blocks, DISK_SIZE);
+  if (fd >= 0) close(fd);
 }
 
 void disk::read_block(blockid_t id, char *buf) {
@@ -15,6 +47,100 @@ void disk::write_block(blockid_t id, const char *buf) {
   memcpy(blocks[id], buf, BLOCK_SIZE);
 }
 
+// Runs of consecutive blocks whose buffers are also consecutive are copied
+// in one go; a file-backed disk would issue one preadv/pwritev per batch.
+void disk::read_blocks(const block_iov *iov, int n) {
+  for (int i = 0, j; i < n; i = j) {
+    for (j = i + 1; j < n && iov[j].id == iov[j - 1].id + 1 &&
+                    iov[j].buf == iov[j - 1].buf + BLOCK_SIZE;
+         j++)
+      ;
+    memcpy(iov[i].buf, blocks[iov[i].id], (j - i) * BLOCK_SIZE);
+  }
+}
+
+void disk::write_blocks(const block_iov *iov, int n) {
+  for (int i = 0, j; i < n; i = j) {
+    for (j = i + 1; j < n && iov[j].id == iov[j - 1].id + 1 &&
+                    iov[j].buf == iov[j - 1].buf + BLOCK_SIZE;
+         j++)
+      ;
+    memcpy(blocks[iov[i].id], iov[i].buf, (j - i) * BLOCK_SIZE);
+  }
+}
+
+// The journal holds the blocks of one write_atomic(), each as its id and
+// data, and then a journal_end. Without the end it was cut short before the
+// image was touched, and is ignored.
+#define JOURNAL_MAGIC 0x4a524e4c
+
+struct journal_end {
+  uint32_t magic;
+  uint32_t count;
+};
+
+void disk::write_atomic(const block_iov *iov, int n) {
+  if (fd >= 0) {
+    std::string buf;
+    buf.reserve(n * (sizeof(blockid_t) + BLOCK_SIZE) + sizeof(journal_end));
+    for (int i = 0; i < n; i++) {
+      buf.append((const char *)&iov[i].id, sizeof(blockid_t));
+      buf.append(iov[i].buf, BLOCK_SIZE);
+    }
+    journal_end end = {JOURNAL_MAGIC, (uint32_t)n};
+    buf.append((const char *)&end, sizeof(end));
+    int jfd = open(journal.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(jfd >= 0);
+    for (size_t done = 0; done < buf.size();) {
+      ssize_t w = write(jfd, buf.data() + done, buf.size() - done);
+      assert(w > 0);
+      done += w;
+    }
+    close(jfd);
+  }
+  for (int i = 0; i < n; i++)
+    memcpy(blocks[iov[i].id], iov[i].buf, BLOCK_SIZE);
+  if (fd >= 0) truncate(journal.c_str(), 0);
+}
+
+// Finish the write_atomic() a crash cut short, if its journal is whole.
+void disk::replay_journal() {
+  int jfd = open(journal.c_str(), O_RDONLY);
+  if (jfd < 0) return;
+  std::string buf;
+  char chunk[BLOCK_SIZE * 16];
+  ssize_t r;
+  while ((r = read(jfd, chunk, sizeof(chunk))) > 0) buf.append(chunk, r);
+  close(jfd);
+
+  const size_t rec = sizeof(blockid_t) + BLOCK_SIZE;
+  journal_end end;
+  if (buf.size() < sizeof(end)) return;
+  memcpy(&end, buf.data() + buf.size() - sizeof(end), sizeof(end));
+  if (end.magic != JOURNAL_MAGIC ||
+      buf.size() != end.count * rec + sizeof(end)) {
+    printf("\tdisk: ignoring an unfinished journal\n");
+    truncate(journal.c_str(), 0);
+    return;
+  }
+  printf("\tdisk: replaying %u journaled blocks\n", end.count);
+  for (uint32_t i = 0; i < end.count; i++) {
+    blockid_t id;
+    memcpy(&id, buf.data() + i * rec, sizeof(id));
+    if (id < BLOCK_NUM)
+      memcpy(blocks[id], buf.data() + i * rec + sizeof(id), BLOCK_SIZE);
+  }
+  sync();
+  truncate(journal.c_str(), 0);
+}
+
+// Schedule write-back of the image. The stores themselves are already in the
+// page cache, which is all a killed process needs; like the persister we do
+// not wait for the device.
+void disk::sync() {
+  if (fd >= 0) msync(blocks, DISK_SIZE, MS_ASYNC);
+}
+
 // block layer -----------------------------------------
 
 // Allocate a free disk block.
@@ -24,64 +150,374 @@ blockid_t block_manager::alloc_block() {
    * note: you should mark the corresponding bit in block bitmap when alloc.
    * you need to think about which block you can start to be allocated.
    */
-  static blockid_t last = IBLOCK(INODE_NUM, sb.nblocks);
-  blockid_t begin = IBLOCK(INODE_NUM, sb.nblocks) + 1;
-  for (blockid_t i = last + 1; i < BLOCK_NUM; i++) {
-    if (!using_blocks[i]) {
-      using_blocks[i] = true;
-      last = i;
-      return i;
-    }
-  }
-  for (blockid_t i = begin; i <= last; i++) {
-    if (!using_blocks[i]) {
-      using_blocks[i] = true;
-      last = i;
-      return i;
-    }
+  // metadata blocks are marked in use by format(), so any clear bit will do
+  std::lock_guard<std::mutex> lock(alloc_mtx);
+  for (uint32_t n = 0; n < BITMAP_WORDS; n++) {
+    uint32_t w = (next_word + n) % BITMAP_WORDS;
+    if (bitmap[w] == ~0ULL) continue;
+    uint32_t bit = __builtin_ctzll(~bitmap[w]);
+    bitmap[w] |= 1ULL << bit;
+    next_word = w;
+    nfree--;
+    blockid_t id = w * 64 + bit;
+    write_bitmap(id);
+    return id;
   }
   printf("\tbm(alloc_block): error! alloc_block failed! no enough space!\n");
   return 0;
 }
 
+// Allocate a run of up to count contiguous blocks, starting at hint if that
+// block is free (so a growing file stays contiguous), otherwise at the first
+// run long enough. Returns the first block and sets len to the run length,
+// which is shorter than count only when no long enough run is left.
+blockid_t block_manager::alloc_extent(uint32_t count, blockid_t hint,
+                                      uint32_t &len) {
+  len = 0;
+  if (count == 0) return 0;
+  std::lock_guard<std::mutex> lock(alloc_mtx);
+  blockid_t start;
+  if (hint > 0 && hint < BLOCK_NUM && is_free(hint))
+    start = hint;
+  else if ((start = find_run(count)) == 0) {
+    printf("\tbm(alloc_extent): error! no enough space!\n");
+    return 0;
+  }
+
+  while (len < count && start + len < BLOCK_NUM && is_free(start + len)) {
+    bitmap[(start + len) / 64] |= 1ULL << ((start + len) % 64);
+    len++;
+  }
+  nfree -= len;
+  next_word = (start + len - 1) / 64;
+  for (blockid_t b = start / BPB; b <= (start + len - 1) / BPB; b++)
+    write_bitmap(b * BPB);
+  return start;
+}
+
+// First-fit search from the cursor for count free blocks in a row; whole
+// words are skipped or counted at once. Falls back to the first free block
+// seen if no run is long enough, and returns 0 if there is none at all.
+// Called with alloc_mtx held.
+blockid_t block_manager::find_run(uint32_t count) {
+  blockid_t first = 0;
+  for (uint32_t pass = 0; pass < 2; pass++) {
+    uint32_t from = pass ? 0 : next_word;
+    uint32_t to = pass ? next_word : BITMAP_WORDS;
+    blockid_t run = 0;
+    uint32_t run_len = 0;
+    for (uint32_t w = from; w < to; w++) {
+      uint64_t used = bitmap[w];
+      if (used == ~0ULL) {
+        run_len = 0;
+        continue;
+      }
+      if (!first) first = w * 64 + __builtin_ctzll(~used);
+      if (used == 0 && run_len + 64 < count) {
+        if (run_len == 0) run = w * 64;
+        run_len += 64;
+        continue;
+      }
+      for (uint32_t bit = 0; bit < 64; bit++) {
+        if (used & (1ULL << bit)) {
+          run_len = 0;
+          continue;
+        }
+        if (run_len == 0) run = w * 64 + bit;
+        if (++run_len >= count) return run;
+      }
+    }
+  }
+  return first;
+}
+
 void block_manager::free_block(uint32_t id) {
   /*
    * your code goes here.
    * note: you should unmark the corresponding bit in the block bitmap when
    * free.
    */
-  using_blocks[id] = 0;
-  return;
+  free_extent(id, 1);
+}
+
+// Free blocks [start, start + len), writing each bitmap block back once.
+void block_manager::free_extent(blockid_t start, uint32_t len) {
+  if (len == 0) return;
+  if (start <= IBLOCK(INODE_NUM, sb.nblocks) || start >= BLOCK_NUM ||
+      len > BLOCK_NUM - start) {
+    printf("\tbm(free_extent): blocks [%u, +%u) are not data blocks!\n",
+           start, len);
+    return;
+  }
+  std::lock_guard<std::mutex> lock(alloc_mtx);
+  for (blockid_t id = start; id < start + len; id++) {
+    uint64_t mask = 1ULL << (id % 64);
+    if (!(bitmap[id / 64] & mask)) continue;
+    bitmap[id / 64] &= ~mask;
+    nfree++;
+  }
+  {
+    // whatever is still cached or held for a free block never needs
+    // writing back
+    std::lock_guard<std::mutex> lock(cache_mtx);
+    for (blockid_t id = start; id < start + len; id++) {
+      auto it = cached.find(id);
+      if (it != cached.end()) {
+        if (it->second->pins) continue;
+        it->second->valid = false;
+        cached.erase(it);
+      }
+      held.erase(id);
+      set_stale(id, false);
+    }
+  }
+  for (blockid_t b = start / BPB; b <= (start + len - 1) / BPB; b++)
+    write_bitmap(b * BPB);
+}
+
+// Write back the bitmap block holding the bit for block id. Called with
+// alloc_mtx held.
+void block_manager::write_bitmap(uint32_t id) {
+  write_block(BBLOCK(id), (const char *)&bitmap[id / BPB * (BPB / 64)]);
 }
 
 // The layout of disk should be like this:
 // |<-sb->|<-free block bitmap->|<-inode table->|<-data->|
-block_manager::block_manager() {
-  d = new disk();
+block_manager::block_manager(const char *image) {
+  d = new disk(image);
+  mounted = false;
+  hand = 0;
+  for (uint32_t i = 0; i < BCACHE_SIZE; i++) {
+    cache[i].valid = false;
+    cache[i].pins = 0;
+  }
+  for (uint32_t w = 0; w < BITMAP_WORDS; w++) stale[w] = 0;
+
+  char buf[BLOCK_SIZE];
+  d->read_block(SBLOCK, buf);
+  memcpy(&sb, buf, sizeof(sb));
+  if (sb.magic != CHFS_MAGIC || sb.version != CHFS_VERSION ||
+      sb.size != BLOCK_SIZE * BLOCK_NUM ||
+      sb.nblocks != BLOCK_NUM || sb.ninodes != INODE_NUM) {
+    format();
+    return;
+  }
 
-  // format the disk
+  // nothing reaches the image between syncs, so even after a crash it is
+  // exactly as of sb.txid: only the in-memory bitmap has to be loaded
+  mounted = true;
+  nfree = 0;
+  next_word = 0;
+  for (blockid_t b = 0; b < BLOCK_NUM; b += BPB)
+    d->read_block(BBLOCK(b), (char *)&bitmap[b / 64]);
+  for (uint32_t w = 0; w < BITMAP_WORDS; w++)
+    nfree += __builtin_popcountll(~bitmap[w]);
+}
+
+// Metadata is cleared explicitly: an old image may still hold the bitmap and
+// inodes of whatever it was used for. The superblock goes first and is only
+// written again by the first sync(), so an image that crashes before that
+// gets formatted again.
+void block_manager::format() {
+  char zero[BLOCK_SIZE] = {0};
+  for (blockid_t i = 0; i <= IBLOCK(INODE_NUM, BLOCK_NUM); i++)
+    d->write_block(i, zero);
+
+  sb.magic = CHFS_MAGIC;
+  sb.version = CHFS_VERSION;
   sb.size = BLOCK_SIZE * BLOCK_NUM;
   sb.nblocks = BLOCK_NUM;
   sb.ninodes = INODE_NUM;
+  sb.txid = 0;
+
+  // everything up to the end of the inode table is in use
+  blockid_t data = IBLOCK(INODE_NUM, BLOCK_NUM) + 1;
+  memset(bitmap, 0, sizeof(bitmap));
+  memset(bitmap, 0xff, data / 64 * sizeof(uint64_t));
+  bitmap[data / 64] = (1ULL << (data % 64)) - 1;
+  for (blockid_t b = 0; b < BLOCK_NUM; b += BPB) write_bitmap(b);
+  next_word = data / 64;
+  nfree = BLOCK_NUM - data;
+}
+
+// Find block id in the cache, or bring it in (from the disk if load is
+// set) in place of a CLOCK victim. Called with cache_mtx held.
+block_buf *block_manager::lookup_buf(blockid_t id, bool load) {
+  auto it = cached.find(id);
+  if (it != cached.end()) {
+    it->second->ref = true;
+    return it->second;
+  }
+  block_buf *b = evict_buf();
+  b->id = id;
+  b->valid = true;
+  b->dirty = false;
+  b->ref = true;
+  auto h = held.find(id);
+  if (h != held.end()) {
+    // it stays dirty: the disk still has the copy of the last sync
+    if (load) memcpy(b->data, h->second.data(), BLOCK_SIZE);
+    b->dirty = true;
+    held.erase(h);
+  } else if (load) {
+    d->read_block(id, b->data);
+  }
+  cached[id] = b;
+  return b;
+}
+
+block_buf *block_manager::evict_buf() {
+  // two sweeps clear every reference bit, so a third finds a victim unless
+  // everything is pinned
+  for (uint32_t n = 0; n < 3 * BCACHE_SIZE; n++) {
+    block_buf *b = &cache[hand];
+    hand = (hand + 1) % BCACHE_SIZE;
+    if (!b->valid) return b;
+    if (b->pins) continue;
+    if (b->ref) {
+      b->ref = false;
+      continue;
+    }
+    if (b->dirty) held[b->id].assign(b->data, BLOCK_SIZE);
+    cached.erase(b->id);
+    b->valid = false;
+    return b;
+  }
+  printf("\tbm(evict_buf): error! every buffer is pinned!\n");
+  assert(0);
+  return NULL;
+}
+
+// The stale bit is set after the cached copy changes and cleared only after
+// the disk has caught up, so a reader that sees it clear may use the disk.
+void block_manager::set_stale(blockid_t id, bool on) {
+  uint64_t mask = 1ULL << (id % 64);
+  if (on)
+    stale[id / 64].fetch_or(mask, std::memory_order_release);
+  else
+    stale[id / 64].fetch_and(~mask, std::memory_order_release);
 }
 
 void block_manager::read_block(uint32_t id, char *buf) {
-  d->read_block(id, buf);
+  std::lock_guard<std::mutex> lock(cache_mtx);
+  memcpy(buf, lookup_buf(id, true)->data, BLOCK_SIZE);
 }
 
 void block_manager::write_block(uint32_t id, const char *buf) {
-  d->write_block(id, buf);
+  std::lock_guard<std::mutex> lock(cache_mtx);
+  block_buf *b = lookup_buf(id, false);
+  memcpy(b->data, buf, BLOCK_SIZE);
+  b->dirty = true;
+  set_stale(id, true);
+}
+
+// Blocks that are cached or held are served from there; the rest go to the
+// disk as a single batch without being cached, so a large file streams past
+// the cache instead of flushing the metadata out of it. Only blocks whose
+// copy in memory is stale need the cache lock at all.
+void block_manager::read_blocks(const std::vector<block_iov> &iov) {
+  std::vector<block_iov> miss, hit;
+  for (const block_iov &v : iov)
+    (is_stale(v.id) ? hit : miss).push_back(v);
+  if (!hit.empty()) {
+    std::lock_guard<std::mutex> lock(cache_mtx);
+    for (const block_iov &v : hit) {
+      auto it = cached.find(v.id);
+      auto h = held.find(v.id);
+      if (it != cached.end())
+        memcpy(v.buf, it->second->data, BLOCK_SIZE);
+      else if (h != held.end())
+        memcpy(v.buf, h->second.data(), BLOCK_SIZE);
+      else
+        miss.push_back(v);  // synced since
+    }
+  }
+  if (!miss.empty()) d->read_blocks(miss.data(), miss.size());
+}
+
+// Uncached blocks are held rather than cached, for the same reason.
+void block_manager::write_blocks(const std::vector<block_iov> &iov) {
+  std::lock_guard<std::mutex> lock(cache_mtx);
+  for (const block_iov &v : iov) {
+    auto it = cached.find(v.id);
+    if (it == cached.end()) {
+      held[v.id].assign(v.buf, BLOCK_SIZE);
+    } else {
+      memcpy(it->second->data, v.buf, BLOCK_SIZE);
+      it->second->dirty = true;
+    }
+    set_stale(v.id, true);
+  }
+}
+
+block_buf *block_manager::pin_block(blockid_t id, bool load) {
+  std::lock_guard<std::mutex> lock(cache_mtx);
+  block_buf *b = lookup_buf(id, load);
+  b->pins++;
+  return b;
+}
+
+void block_manager::unpin_block(block_buf *b, bool dirty) {
+  std::lock_guard<std::mutex> lock(cache_mtx);
+  assert(b->pins > 0);
+  if (dirty) {
+    b->dirty = true;
+    set_stale(b->id, true);
+  }
+  b->pins--;
+}
+
+// Write every dirty block, with the superblock stamped with txid, to the
+// disk in one atomic update: the image goes from the state of one sync to
+// that of the next, with nothing in between. The caller must make sure no
+// change is in flight (see commit_tx).
+void block_manager::sync(uint64_t txid) {
+  std::lock_guard<std::mutex> lock(cache_mtx);
+  std::vector<block_iov> iov;
+  for (uint32_t i = 0; i < BCACHE_SIZE; i++) {
+    block_buf *b = &cache[i];
+    if (b->valid && b->dirty) iov.push_back({b->id, b->data});
+  }
+  for (auto &h : held) iov.push_back({h.first, &h.second[0]});
+  char super[BLOCK_SIZE] = {0};
+  sb.txid = txid;
+  memcpy(super, &sb, sizeof(sb));
+  iov.push_back({SBLOCK, super});
+  d->write_atomic(iov.data(), iov.size());
+  d->sync();
+
+  for (uint32_t i = 0; i < BCACHE_SIZE; i++) {
+    block_buf *b = &cache[i];
+    if (!b->valid || !b->dirty) continue;
+    b->dirty = false;
+    set_stale(b->id, false);
+  }
+  for (auto &h : held) set_stale(h.first, false);
+  held.clear();
 }
 
 // inode layer -----------------------------------------
 
-inode_manager::inode_manager() {
-  bm = new block_manager();
+inode_manager::inode_manager(const char *image) {
+  bm = new block_manager(image);
+  use_extents = true;
+  atime_policy = extent_protocol::ATIME_RELATIME;
+
+  if (bm->mounted)
+    bm->read_block(IBMBLOCK(bm->sb.nblocks), (char *)inode_bitmap);
+  else
+    memset(inode_bitmap, 0, sizeof(inode_bitmap));
+  for (uint32_t inum = 1; inum <= INODE_NUM; inum++)
+    if (!inode_used(inum)) free_inums.push_back(inum);
+  if (bm->mounted) return;
+
   uint32_t root_dir = alloc_inode(extent_protocol::T_DIR);
   if (root_dir != 1) {
     printf("\tim: error! alloc first inode %d, should be 1\n", root_dir);
     exit(0);
   }
+  // the image only becomes mountable here, with the root in place
+  sync(0);
 }
 
 /* Create a new file.
@@ -92,29 +528,56 @@ uint32_t inode_manager::alloc_inode(uint32_t type, uint32_t pos) {
    * note: the normal inode block should begin from the 2nd inode block.
    * the 1st is used for root_dir, see inode_manager::inode_manager().
    */
-  static int inum = 0;
-  // pos不为0表示强制alloc pos
-  if (pos > 0) inum = pos - 1;
-  for (int i = 0; i < INODE_NUM; i++) {
-    inum = inum % INODE_NUM + 1;
-    inode_t *ino = get_inode(inum);
-    if (!ino) {
-      ino = new inode_t;
-      bzero(ino, sizeof(inode_t));
-      ino->type = type;
-      ino->size = 0;
-      ino->atime = (unsigned int)time(NULL);
-      ino->ctime = (unsigned int)time(NULL);
-      ino->mtime = (unsigned int)time(NULL);
-      put_inode(inum, ino);
-      free(ino);
-      break;
+  uint32_t inum = 0;
+  {
+    std::lock_guard<std::mutex> lock(ialloc_mtx);
+    // pos不为0表示强制alloc pos
+    if (pos > 0 && pos <= INODE_NUM && !inode_used(pos)) {
+      inum = pos;
+    } else {
+      if (pos > 0) printf("\tim: can't alloc inode %u, it is in use\n", pos);
+      while (!free_inums.empty() && inode_used(free_inums.front()))
+        free_inums.pop_front();
+      if (free_inums.empty()) {
+        printf("\tim: error! no free inode left\n");
+        return 0;
+      }
+      inum = free_inums.front();
+      free_inums.pop_front();
     }
-    free(ino);
+    mark_inode(inum, true);
+  }
+
+  inode_t fresh;
+  bzero(&fresh, sizeof(inode_t));
+  {
+    // free_inode leaves the old generation in place
+    std::lock_guard<std::mutex> lock(icache_mtx);
+    fresh.gen = lookup_inode(inum)->ino.gen + 1;
   }
+  fresh.type = type;
+  // everything starts out inline; the block map format is picked when the
+  // file outgrows the inode
+  fresh.flags = INODE_INLINE;
+  fresh.size = 0;
+  fresh.atime = (unsigned int)time(NULL);
+  fresh.ctime = (unsigned int)time(NULL);
+  fresh.mtime = (unsigned int)time(NULL);
+  put_inode(inum, &fresh);
   return inum;
 }
 
+// Set or clear the bitmap bit of inum and write the bitmap back. Called
+// with ialloc_mtx held.
+void inode_manager::mark_inode(uint32_t inum, bool used) {
+  uint32_t bit = inum - 1;
+  if (used)
+    inode_bitmap[bit / 64] |= 1ULL << (bit % 64);
+  else
+    inode_bitmap[bit / 64] &= ~(1ULL << (bit % 64));
+  bm->write_block(IBMBLOCK(bm->sb.nblocks), (const char *)inode_bitmap);
+}
+
 void inode_manager::free_inode(uint32_t inum) {
   /*
    * your code goes here.
@@ -125,15 +588,75 @@ void inode_manager::free_inode(uint32_t inum) {
   if (ino == NULL) return;
   ino->type = 0;
   put_inode(inum, ino);
-  free(ino);
+  release_inode(inum);
+
+  // The inum only goes back on free_inums through recycle_inode, once the
+  // removal has committed: a transaction that took it over and committed
+  // first would log a create of an inum the log still has in use.
+  std::lock_guard<std::mutex> lock(ialloc_mtx);
+  mark_inode(inum, false);
   return;
 }
 
+void inode_manager::recycle_inode(uint32_t inum) {
+  std::lock_guard<std::mutex> lock(ialloc_mtx);
+  free_inums.push_back(inum);
+}
+
+// Return the cache entry for inum, reading it in if needed. Called with
+// icache_mtx held.
+cached_inode *inode_manager::lookup_inode(uint32_t inum) {
+  auto it = icache.find(inum);
+  if (it != icache.end()) return &it->second;
+
+  if (icache.size() >= ICACHE_SIZE) {
+    // make room by dropping unreferenced entries, a quarter at a time
+    for (auto v = icache.begin();
+         v != icache.end() && icache.size() >= ICACHE_SIZE * 3 / 4;) {
+      if (v->second.ref) {
+        ++v;
+        continue;
+      }
+      if (v->second.dirty) write_inode(v->first, &v->second.ino);
+      v = icache.erase(v);
+    }
+  }
+
+  cached_inode &c = icache[inum];
+  block_buf *b = bm->pin_block(IBLOCK(inum, bm->sb.nblocks));
+  c.ino = *((inode_t *)b->data + inum % IPB);
+  bm->unpin_block(b, false);
+  c.ref = 0;
+  c.dirty = false;
+  return &c;
+}
+
+void inode_manager::write_inode(uint32_t inum, const inode_t *ino) {
+  block_buf *b = bm->pin_block(IBLOCK(inum, bm->sb.nblocks));
+  *((inode_t *)b->data + inum % IPB) = *ino;
+  bm->unpin_block(b, true);
+}
+
+void inode_manager::flush_inodes() {
+  std::lock_guard<std::mutex> lock(icache_mtx);
+  for (auto &v : icache) {
+    if (!v.second.dirty) continue;
+    write_inode(v.first, &v.second.ino);
+    v.second.dirty = false;
+  }
+}
+
+// Write every change so far to the image at once, as the state after txid.
+// Dirty inodes go to their blocks first. The caller must make sure no
+// mutation is in flight (see commit_tx).
+void inode_manager::sync(uint64_t txid) {
+  flush_inodes();
+  bm->sync(txid);
+}
+
 /* Return an inode structure by inum, NULL otherwise.
- * Caller should release the memory. */
+ * The inode stays cached until the caller calls release_inode(). */
 inode_t *inode_manager::get_inode(uint32_t inum) {
-  inode_t *ino_disk;
-  char buf[BLOCK_SIZE];
 #ifndef TEST
   printf("\tim: get_inode %d\n", inum);
 #endif
@@ -142,31 +665,356 @@ inode_t *inode_manager::get_inode(uint32_t inum) {
     return NULL;
   }
 
-  bm->read_block(IBLOCK(inum, bm->sb.nblocks), buf);
-  ino_disk = (inode_t *)buf + inum % IPB;
-
-  if (ino_disk->type == 0) {
+  std::lock_guard<std::mutex> lock(icache_mtx);
+  cached_inode *c = lookup_inode(inum);
+  if (c->ino.type == 0) {
     // printf("\tim: (get node) inode doesn't exist.\n");
     return NULL;
   }
-
-  inode_t *ino = new inode_t;
-  *ino = *ino_disk;
-  return ino;
+  c->ref++;
+  return &c->ino;
 }
 
+/* Mark inode inum dirty, copying ino into the cache if it isn't the cached
+ * inode itself. It is written back lazily. */
 void inode_manager::put_inode(uint32_t inum, inode_t *ino) {
-  char buf[BLOCK_SIZE];
-  inode_t *ino_disk;
 #ifndef TEST
   printf("\tim: put_inode %d\n", inum);
 #endif
   if (ino == NULL) return;
 
-  bm->read_block(IBLOCK(inum, bm->sb.nblocks), buf);
-  ino_disk = (inode_t *)buf + inum % IPB;
-  *ino_disk = *ino;
-  bm->write_block(IBLOCK(inum, bm->sb.nblocks), buf);
+  std::lock_guard<std::mutex> lock(icache_mtx);
+  cached_inode *c = lookup_inode(inum);
+  if (&c->ino != ino) c->ino = *ino;
+  c->dirty = true;
+}
+
+void inode_manager::release_inode(uint32_t inum) {
+  std::lock_guard<std::mutex> lock(icache_mtx);
+  auto it = icache.find(inum);
+  assert(it != icache.end() && it->second.ref > 0);
+  it->second.ref--;
+}
+
+// Find where block n is mapped: the blocks[] slot to start from, and the
+// entry index at each level of indirection below it. Returns the depth.
+static int bmap_locate(uint32_t n, uint32_t &slot, uint32_t idx[3]) {
+  if (n < NDIRECT) {
+    slot = n;
+    return 0;
+  }
+  n -= NDIRECT;
+  if (n < NINDIRECT) {
+    slot = NDIRECT;
+    idx[0] = n;
+    return 1;
+  }
+  n -= NINDIRECT;
+  if (n < NDINDIRECT) {
+    slot = NDIRECT + 1;
+    idx[0] = n / NINDIRECT;
+    idx[1] = n % NINDIRECT;
+    return 2;
+  }
+  n -= NDINDIRECT;
+  slot = NDIRECT + 2;
+  idx[0] = n / NDINDIRECT;
+  idx[1] = n / NINDIRECT % NINDIRECT;
+  idx[2] = n % NINDIRECT;
+  return 3;
+}
+
+bmap_cursor::bmap_cursor(block_manager *bm, inode_t *ino)
+    : bm(bm), ino(ino), hint(0) {
+  for (int d = 0; d < 3; d++) {
+    path[d] = NULL;
+    dirty[d] = false;
+  }
+}
+
+bmap_cursor::~bmap_cursor() {
+  for (int d = 0; d < 3; d++)
+    if (path[d]) bm->unpin_block(path[d], dirty[d]);
+}
+
+// Pin indirect block id at the given depth of the path, zeroing it if it
+// was just allocated.
+void bmap_cursor::load(int depth, blockid_t id, bool fresh) {
+  if (path[depth] && path[depth]->id == id) return;
+  if (path[depth]) bm->unpin_block(path[depth], dirty[depth]);
+  path[depth] = bm->pin_block(id, !fresh);
+  dirty[depth] = fresh;
+  if (fresh) bzero(path[depth]->data, BLOCK_SIZE);
+}
+
+// Return the map entry of block n, or NULL if an indirect block on the way
+// is missing and can't (or shouldn't) be allocated.
+blockid_t *bmap_cursor::entry(uint32_t n, bool alloc) {
+  uint32_t slot, idx[3];
+  int depth = bmap_locate(n, slot, idx);
+  blockid_t *e = &ino->blocks[slot];
+  for (int d = 0; d < depth; d++) {
+    bool fresh = false;
+    if (*e == 0) {
+      uint32_t len;
+      if (!alloc || (*e = bm->alloc_extent(1, hint, len)) == 0) return NULL;
+      hint = *e + 1;
+      fresh = true;
+      if (d > 0) dirty[d - 1] = true;
+    }
+    load(d, *e, fresh);
+    e = (blockid_t *)path[d]->data + idx[d];
+  }
+  return e;
+}
+
+blockid_t bmap_cursor::get(uint32_t n) {
+  blockid_t *e = entry(n, false);
+  return e ? *e : 0;
+}
+
+bool bmap_cursor::prepare(uint32_t n) { return entry(n, true) != NULL; }
+
+void bmap_cursor::set(uint32_t n, blockid_t id) {
+  uint32_t slot, idx[3];
+  int depth = bmap_locate(n, slot, idx);
+  blockid_t *e = entry(n, true);
+  if (e == NULL) return;
+  *e = id;
+  if (depth > 0) dirty[depth - 1] = true;
+}
+
+uint32_t bmap_cursor::run_limit(uint32_t n) {
+  uint32_t slot, idx[3];
+  int depth = bmap_locate(n, slot, idx);
+  return depth == 0 ? NDIRECT - n : NINDIRECT - idx[depth - 1];
+}
+
+static extent *ext_records(extent_header *h) { return (extent *)(h + 1); }
+
+// Number of records in node h that start at or before block n.
+static uint32_t ext_upper(extent_header *h, uint32_t n) {
+  extent *e = ext_records(h);
+  uint32_t lo = 0, hi = h->count;
+  while (lo < hi) {
+    uint32_t mid = (lo + hi) / 2;
+    if (e[mid].lblk <= n)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// true if extent b continues extent a, both logically and on disk
+static bool ext_adjacent(const extent &a, const extent &b) {
+  return a.lblk + a.len == b.lblk && a.pblk + a.len == b.pblk;
+}
+
+blockid_t extent_tree::lookup(uint32_t n, uint32_t &len) {
+  extent_header *h = &ino->ext.hdr;
+  block_buf *b = NULL;
+  // first block past the subtree being searched
+  uint32_t end = MAXFILE;
+  blockid_t id = 0;
+  for (;;) {
+    extent *e = ext_records(h);
+    uint32_t i = ext_upper(h, n);
+    if (h->depth == 0) {
+      if (i > 0 && n < e[i - 1].lblk + e[i - 1].len) {
+        id = e[i - 1].pblk + (n - e[i - 1].lblk);
+        len = e[i - 1].lblk + e[i - 1].len - n;
+      } else {
+        len = (i < h->count ? e[i].lblk : end) - n;
+      }
+      break;
+    }
+    uint32_t c = i ? i - 1 : 0;
+    if (c + 1 < h->count) end = e[c + 1].lblk;
+    blockid_t child = e[c].pblk;
+    if (b) bm->unpin_block(b, false);
+    b = bm->pin_block(child);
+    h = (extent_header *)b->data;
+  }
+  if (b) bm->unpin_block(b, false);
+  return id;
+}
+
+bool extent_tree::insert(uint32_t lblk, blockid_t pblk, uint32_t len) {
+  extent x = {lblk, pblk, len};
+  bool split;
+  extent sib;
+  // Every block the splits need is taken before any node changes: running
+  // out halfway would leave a split child whose parent can't point to it.
+  for (uint32_t n = split_cost(x); n > 0; n--) {
+    blockid_t id = bm->alloc_block();
+    if (id == 0) {
+      for (blockid_t s : spare) bm->free_block(s);
+      spare.clear();
+      return false;
+    }
+    spare.push_back(id);
+  }
+  // the root never splits, it grows the tree instead
+  bool ok = insert_node(&ino->ext.hdr, EXT_ROOT, x, split, sib);
+  for (blockid_t s : spare) bm->free_block(s);
+  spare.clear();
+  return ok;
+}
+
+// Number of blocks inserting x may allocate: one per full node on the path
+// up from the leaf, the root included since it grows by one.
+uint32_t extent_tree::split_cost(const extent &x) {
+  extent_header *h = &ino->ext.hdr;
+  uint32_t max = EXT_ROOT, need = 0;
+  block_buf *b = NULL;
+  for (;;) {
+    extent *e = ext_records(h);
+    uint32_t i = ext_upper(h, x.lblk);
+    // a node with room takes the split of its child without splitting
+    need = h->count < max ? 0 : need + 1;
+    if (h->depth == 0) {
+      // x merges into a neighbour instead of taking a record
+      if ((i > 0 && ext_adjacent(e[i - 1], x)) ||
+          (i < h->count && ext_adjacent(x, e[i])))
+        need = 0;
+      break;
+    }
+    blockid_t child = e[i ? i - 1 : 0].pblk;
+    if (b) bm->unpin_block(b, false);
+    b = bm->pin_block(child);
+    h = (extent_header *)b->data;
+    max = EXT_PER_BLOCK;
+  }
+  if (b) bm->unpin_block(b, false);
+  return need;
+}
+
+// Insert x into the subtree at h, a node of at most max records. If h had to
+// split, split is set and sib indexes the new right sibling.
+bool extent_tree::insert_node(extent_header *h, uint32_t max, const extent &x,
+                              bool &split, extent &sib) {
+  extent *e = ext_records(h);
+  uint32_t i = ext_upper(h, x.lblk);
+  split = false;
+  if (h->depth == 0) {
+    // a file grown in runs keeps extending its last extent
+    if (i > 0 && ext_adjacent(e[i - 1], x)) {
+      e[i - 1].len += x.len;
+      if (i < h->count && ext_adjacent(e[i - 1], e[i])) {
+        e[i - 1].len += e[i].len;
+        memmove(e + i, e + i + 1, (h->count - i - 1) * sizeof(extent));
+        h->count--;
+      }
+      return true;
+    }
+    if (i < h->count && ext_adjacent(x, e[i])) {
+      e[i].lblk = x.lblk;
+      e[i].pblk = x.pblk;
+      e[i].len += x.len;
+      return true;
+    }
+    return add_record(h, max, i, x, split, sib);
+  }
+
+  uint32_t c = i ? i - 1 : 0;
+  if (x.lblk < e[c].lblk) e[c].lblk = x.lblk;
+  block_buf *b = bm->pin_block(e[c].pblk);
+  bool child_split;
+  extent child_sib;
+  bool ok = insert_node((extent_header *)b->data, EXT_PER_BLOCK, x,
+                        child_split, child_sib);
+  bm->unpin_block(b, true);
+  if (!ok || !child_split) return ok;
+  return add_record(h, max, c + 1, child_sib, split, sib);
+}
+
+// Put record x at position i of node h, splitting h if it is full.
+bool extent_tree::add_record(extent_header *h, uint32_t max, uint32_t i,
+                             const extent &x, bool &split, extent &sib) {
+  extent *e = ext_records(h);
+  split = false;
+  if (h->count < max) {
+    memmove(e + i + 1, e + i, (h->count - i) * sizeof(extent));
+    e[i] = x;
+    h->count++;
+    return true;
+  }
+
+  // taken by insert
+  if (spare.empty()) return false;
+  blockid_t id = spare.back();
+  spare.pop_back();
+  block_buf *b = bm->pin_block(id, false);
+  bzero(b->data, BLOCK_SIZE);
+  extent_header *nh = (extent_header *)b->data;
+  bool ok;
+  if (h == &ino->ext.hdr) {
+    // the root can't split: its records move into the new block, which
+    // becomes its only child
+    *nh = *h;
+    memcpy(ext_records(nh), e, h->count * sizeof(extent));
+    h->depth++;
+    h->count = 1;
+    e[0].pblk = id;
+    e[0].len = 0;
+    ok = add_record(nh, EXT_PER_BLOCK, i, x, split, sib);
+  } else {
+    // move the upper half to the new right sibling; when appending, move
+    // nothing so a sequentially grown tree stays packed
+    uint32_t keep = i == h->count ? h->count : h->count / 2;
+    nh->depth = h->depth;
+    nh->count = h->count - keep;
+    memcpy(ext_records(nh), e + keep, nh->count * sizeof(extent));
+    h->count = keep;
+    bool unused;
+    if (i > keep || keep == max)
+      ok = add_record(nh, EXT_PER_BLOCK, i - keep, x, unused, sib);
+    else
+      ok = add_record(h, max, i, x, unused, sib);
+    split = true;
+    sib.lblk = ext_records(nh)[0].lblk;
+    sib.pblk = id;
+    sib.len = 0;
+  }
+  bm->unpin_block(b, true);
+  return ok;
+}
+
+void extent_tree::truncate(uint32_t from) {
+  truncate_node(&ino->ext.hdr, from);
+  if (ino->ext.hdr.count == 0) ino->ext.hdr.depth = 0;
+}
+
+// Drop everything node h maps from block `from` on, freeing the data and any
+// tree block left empty. Returns true if h changed.
+bool extent_tree::truncate_node(extent_header *h, uint32_t from) {
+  extent *e = ext_records(h);
+  bool changed = false;
+  while (h->count > 0) {
+    extent &last = e[h->count - 1];
+    if (h->depth == 0) {
+      if (last.lblk + last.len <= from) break;
+      uint32_t keep = last.lblk < from ? from - last.lblk : 0;
+      bm->free_extent(last.pblk + keep, last.len - keep);
+      changed = true;
+      if (keep) {
+        last.len = keep;
+        break;
+      }
+    } else {
+      block_buf *b = bm->pin_block(last.pblk);
+      extent_header *child = (extent_header *)b->data;
+      bool child_changed = truncate_node(child, from);
+      bool empty = child->count == 0;
+      bm->unpin_block(b, child_changed);
+      if (!empty) break;
+      bm->free_block(last.pblk);
+      changed = true;
+    }
+    h->count--;
+  }
+  return changed;
 }
 
 blockid_t inode_manager::get_nth_block(inode_t *ino, uint32_t n) {
@@ -178,15 +1026,11 @@ blockid_t inode_manager::get_nth_block(inode_t *ino, uint32_t n) {
     printf("\tim(get_nth_block): nth(%d) is out of range!.", n);
     return 0;
   }
-  if (n < NDIRECT) {
-    return ino->blocks[n];
-  }
-  // NDIRECT <= n < MAXFILE
-  uint32_t num = NDIRECT + (n - NDIRECT) / NINDIRECT;
-  blockid_t id = ino->blocks[num];
-  char buf[BLOCK_SIZE];
-  bm->read_block(id, buf);
-  return ((blockid_t *)buf)[n - NDIRECT];
+  uint32_t len;
+  if (ino->flags & INODE_INLINE) return 0;
+  if (ino->flags & INODE_EXTENTS) return extent_tree(bm, ino).lookup(n, len);
+  bmap_cursor map(bm, ino);
+  return map.get(n);
 }
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
@@ -199,6 +1043,7 @@ void inode_manager::read_file(uint32_t inum, char **buf_out, int *size) {
    * note: read blocks related to inode number inum,
    * and copy them to buf_out
    */
+  std::shared_lock<std::shared_mutex> lock(inode_lock(inum));
   inode_t *ino = get_inode(inum);
   if (ino == NULL) {
     printf("\tim(read_fild): didn't find inode %d\n", inum);
@@ -206,21 +1051,22 @@ void inode_manager::read_file(uint32_t inum, char **buf_out, int *size) {
   }
   *size = ino->size;
   *buf_out = (char *)malloc(*size);
+  if (ino->flags & INODE_INLINE) {
+    memcpy(*buf_out, ino->data, *size);
+    if (touch_atime(ino)) put_inode(inum, ino);
+    release_inode(inum);
+    return;
+  }
   uint32_t block_num = ino->size / BLOCK_SIZE;
   uint32_t remain_size = ino->size % BLOCK_SIZE;
-  for (uint32_t i = 0; i < block_num; i++) {
-    blockid_t id = get_nth_block(ino, i);
-    bm->read_block(id, *buf_out + BLOCK_SIZE * i);
-  }
+  read_blocks(ino, 0, block_num, *buf_out);
   if (remain_size) {
     char buf[BLOCK_SIZE];
-    blockid_t id = get_nth_block(ino, block_num);
-    bm->read_block(id, buf);
+    read_blocks(ino, block_num, 1, buf);
     memcpy(*buf_out + BLOCK_SIZE * block_num, buf, remain_size);
   }
-  ino->atime = time(NULL);
-  put_inode(inum, ino);
-  free(ino);
+  if (touch_atime(ino)) put_inode(inum, ino);
+  release_inode(inum);
 }
 
 /* alloc/free blocks if needed */
@@ -237,66 +1083,186 @@ void inode_manager::write_file(uint32_t inum, const char *buf, int size) {
            MAXFILE * BLOCK_SIZE);
     return;
   }
+  std::unique_lock<std::shared_mutex> lock(inode_lock(inum));
   inode_t *ino = get_inode(inum);
   if (ino == NULL) {
     printf("\tim(wrirte_fild): inode %d doesn't exist!\n", inum);
     return;
   }
 
+  if ((uint32_t)size <= INLINE_MAX) {
+    // small enough to live in the inode, whatever it was before
+    free_blocks(ino, 0);
+    bzero(ino->data, INLINE_MAX);
+    memcpy(ino->data, buf, size);
+    ino->flags = INODE_INLINE;
+    ino->size = size;
+    ino->atime = ino->mtime = ino->ctime = time(NULL);
+    put_inode(inum, ino);
+    release_inode(inum);
+    return;
+  }
+  if (ino->flags & INODE_INLINE) {
+    // everything gets rewritten anyway, so just start with no blocks
+    ino->flags = use_extents ? INODE_EXTENTS : 0;
+    bzero(ino->data, INLINE_MAX);
+    ino->size = 0;
+  }
+
   // reset the block number
   uint32_t old_blocks = (ino->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
   uint32_t new_blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-  if (old_blocks < new_blocks) {
-    for (uint32_t i = old_blocks; i < new_blocks; i++) alloc_nth_block(ino, i);
-  } else if (old_blocks > new_blocks) {
-    for (uint32_t i = new_blocks; i < old_blocks; i++) free_nth_block(ino, i);
-  }
+  if (old_blocks > new_blocks) free_blocks(ino, new_blocks);
 
-  ino->size = size;
-  ino->atime = ino->mtime = ino->ctime = time(NULL);
-
-  // write blocks;
+  // write blocks; zero blocks that aren't mapped yet stay holes
   uint32_t block_num = size / BLOCK_SIZE;
   uint32_t remain_size = size % BLOCK_SIZE;
-  for (uint32_t i = 0; i < block_num; i++) {
-    blockid_t id = get_nth_block(ino, i);
-    bm->write_block(id, buf + BLOCK_SIZE * i);
-  }
-  if (remain_size) {
+  uint32_t n = write_blocks(ino, 0, block_num, buf);
+  if (n == block_num && remain_size) {
     char tmp[BLOCK_SIZE] = {0};
-    blockid_t id = get_nth_block(ino, block_num);
     memcpy(tmp, buf + block_num * BLOCK_SIZE, remain_size);
-    bm->write_block(id, tmp);
+    n += write_blocks(ino, block_num, 1, tmp);
+  }
+  if (n < new_blocks) {
+    printf("\tim(wrirte_fild): out of space, truncated to %u blocks\n", n);
+    free_blocks(ino, n);
+    size = MIN((uint32_t)size, n * BLOCK_SIZE);
   }
 
+  ino->size = size;
+  ino->atime = ino->mtime = ino->ctime = time(NULL);
+
   put_inode(inum, ino);
-  free(ino);
+  release_inode(inum);
   return;
 }
 
-void inode_manager::alloc_nth_block(inode_t *ino, uint32_t n) {
+/* Read up to len bytes at offset off of file inum into buf, touching only
+ * the blocks they are in; holes read as zeros. Return the number of bytes
+ * read, short at EOF, or -1 if the file doesn't exist. */
+int inode_manager::read_range(uint32_t inum, unsigned int off, unsigned int len,
+                              char *buf) {
+  std::shared_lock<std::shared_mutex> lock(inode_lock(inum));
+  inode_t *ino = get_inode(inum);
+  if (ino == NULL) {
+    printf("\tim(read_range): didn't find inode %d\n", inum);
+    return -1;
+  }
+  unsigned int n = off < ino->size ? MIN(len, ino->size - off) : 0;
+  if (ino->flags & INODE_INLINE) {
+    memcpy(buf, ino->data + off, n);
+  } else {
+    // whole blocks go straight into buf, partial ones through tmp
+    for (unsigned int done = 0; done < n;) {
+      uint32_t b = (off + done) / BLOCK_SIZE;
+      uint32_t skip = (off + done) % BLOCK_SIZE;
+      if (skip == 0 && n - done >= BLOCK_SIZE) {
+        uint32_t count = (n - done) / BLOCK_SIZE;
+        read_blocks(ino, b, count, buf + done);
+        done += count * BLOCK_SIZE;
+      } else {
+        char tmp[BLOCK_SIZE];
+        uint32_t k = MIN(BLOCK_SIZE - skip, n - done);
+        read_blocks(ino, b, 1, tmp);
+        memcpy(buf + done, tmp + skip, k);
+        done += k;
+      }
+    }
+  }
+  if (touch_atime(ino)) put_inode(inum, ino);
+  release_inode(inum);
+  return n;
+}
+
+/* Write len bytes of buf at offset off of file inum, extending the file if
+ * they end past EOF. Only the blocks the range covers are written, and only
+ * holes getting nonzero data are allocated, so writing past EOF leaves a
+ * hole behind. Return the number of bytes written, short if the disk fills
+ * up, or -1 on error. */
+int inode_manager::write_range(uint32_t inum, unsigned int off, const char *buf,
+                               unsigned int len) {
+  if ((uint64_t)off + len > (uint64_t)MAXFILE * BLOCK_SIZE) {
+    printf("\tim(write_range): range is out of range[0,%ld]\n",
+           MAXFILE * BLOCK_SIZE);
+    return -1;
+  }
+  // like write(2), writing nothing never extends the file
+  if (len == 0) return 0;
+  std::unique_lock<std::shared_mutex> lock(inode_lock(inum));
+  inode_t *ino = get_inode(inum);
   if (ino == NULL) {
-    printf("\tim(alloc_nth_block): inode is NULL!.");
-    return;
+    printf("\tim(write_range): inode %d doesn't exist!\n", inum);
+    return -1;
   }
-  if (n < 0 || n >= MAXFILE) {
-    printf("\tim(alloc_nth_block): nth(%d) is out of range!.", n);
-    return;
+
+  if (ino->flags & INODE_INLINE) {
+    if (off + len <= INLINE_MAX) {
+      memcpy(ino->data + off, buf, len);
+      if (off + len > ino->size) ino->size = off + len;
+      ino->mtime = ino->ctime = time(NULL);
+      put_inode(inum, ino);
+      release_inode(inum);
+      return len;
+    }
+    if (!promote_inline(ino)) {
+      printf("\tim(write_range): out of space, can't move inode %d out of "
+             "line\n", inum);
+      release_inode(inum);
+      return 0;
+    }
   }
-  if (n < NDIRECT) {
-    ino->blocks[n] = bm->alloc_block();
-    return;
+
+  uint32_t old_blocks = (ino->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  unsigned int done = 0;
+  while (done < len) {
+    uint32_t b = (off + done) / BLOCK_SIZE;
+    uint32_t skip = (off + done) % BLOCK_SIZE;
+    if (skip == 0 && len - done >= BLOCK_SIZE) {
+      uint32_t count = (len - done) / BLOCK_SIZE;
+      uint32_t n = write_blocks(ino, b, count, buf + done);
+      done += n * BLOCK_SIZE;
+      if (n < count) break;
+    } else {
+      // a partial block keeps the rest of its bytes; past EOF those are
+      // zeros
+      char tmp[BLOCK_SIZE] = {0};
+      uint32_t k = MIN(BLOCK_SIZE - skip, len - done);
+      if (b < old_blocks) read_blocks(ino, b, 1, tmp);
+      memcpy(tmp + skip, buf + done, k);
+      if (write_blocks(ino, b, 1, tmp) == 0) break;
+      done += k;
+    }
   }
-  // NDIRECT <= n < MAXFILE
-  uint32_t num = NDIRECT + (n - NDIRECT) / NINDIRECT;
-  if (!ino->blocks[num]) {
-    printf("\tim(alloc_nth_block): alloc new INDIRECT BLOCK!\n");
-    ino->blocks[num] = bm->alloc_block();
+  if (done < len)
+    printf("\tim(write_range): out of space, wrote %u of %u bytes\n", done,
+           len);
+
+  if (done > 0 && off + done > ino->size) ino->size = off + done;
+  ino->mtime = ino->ctime = time(NULL);
+  put_inode(inum, ino);
+  release_inode(inum);
+  return done;
+}
+
+// Update the atime of ino for a read, if the atime policy asks for it.
+// Returns true if it changed; otherwise the read leaves the inode clean.
+bool inode_manager::touch_atime(inode_t *ino) {
+  unsigned int now = time(NULL);
+  unsigned int atime = __atomic_load_n(&ino->atime, __ATOMIC_RELAXED);
+  switch (atime_policy) {
+    case extent_protocol::ATIME_NOATIME:
+      return false;
+    case extent_protocol::ATIME_RELATIME:
+      if (atime > ino->mtime && atime > ino->ctime &&
+          now < atime + 24 * 60 * 60)
+        return false;
+      break;
+    case extent_protocol::ATIME_STRICT:
+      break;
   }
-  char buf[BLOCK_SIZE];
-  bm->read_block(ino->blocks[num], buf);
-  ((blockid_t *)buf)[n - NDIRECT] = bm->alloc_block();
-  bm->write_block(ino->blocks[num], buf);
+  if (atime == now) return false;
+  // concurrent readers of the file may race to store the same time
+  return __atomic_exchange_n(&ino->atime, now, __ATOMIC_RELAXED) != now;
 }
 
 void inode_manager::get_attr(uint32_t inum, extent_protocol::attr &a) {
@@ -309,14 +1275,17 @@ void inode_manager::get_attr(uint32_t inum, extent_protocol::attr &a) {
 
   printf("\tim: get_attr %d\n", inum);
 
+  std::shared_lock<std::shared_mutex> lock(inode_lock(inum));
   ino_disk = get_inode(inum);
   if (!ino_disk) return;
-  a.atime = ino_disk->atime;
+  // readers may be updating atime under the same shared lock
+  a.atime = __atomic_load_n(&ino_disk->atime, __ATOMIC_RELAXED);
   a.ctime = ino_disk->ctime;
   a.mtime = ino_disk->mtime;
   a.size = ino_disk->size;
   a.type = ino_disk->type;
-  free(ino_disk);
+  a.gen = ino_disk->gen;
+  release_inode(inum);
 }
 
 void inode_manager::remove_file(uint32_t inum) {
@@ -324,19 +1293,204 @@ void inode_manager::remove_file(uint32_t inum) {
    * your code goes here
    * note: you need to consider about both the data block and inode of the file
    */
+  std::unique_lock<std::shared_mutex> lock(inode_lock(inum));
   inode_t *ino = get_inode(inum);
   if (ino == NULL) return;
 
-  uint32_t block_num = (ino->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-  // uint32_t remain_size = size % BLOCK_SIZE;
-  for (uint32_t i = 0; i < block_num; i++) free_nth_block(ino, i);
-  if (block_num > NDIRECT) bm->free_block(ino->blocks[NDIRECT]);
+  free_blocks(ino, 0);
 
   free_inode(inum);
-  free(ino);
+  release_inode(inum);
   return;
 }
 
-void inode_manager::free_nth_block(inode_t *ino, uint32_t n) {
-  bm->free_block(get_nth_block(ino, n));
+// Map new blocks to the hole [from, to) of the file, in contiguous runs that
+// continue right after the block before it. Returns the end of what was
+// mapped, which is short of to only when the disk is full.
+uint32_t inode_manager::alloc_blocks(inode_t *ino, uint32_t from, uint32_t to) {
+  uint32_t n = from;
+  uint32_t len;
+  blockid_t prev = from ? get_nth_block(ino, from - 1) : 0;
+  if (ino->flags & INODE_EXTENTS) {
+    extent_tree tree(bm, ino);
+    blockid_t hint = prev ? prev + 1 : 0;
+    while (n < to) {
+      blockid_t start = bm->alloc_extent(to - n, hint, len);
+      if (start == 0) break;
+      if (!tree.insert(n, start, len)) {
+        bm->free_extent(start, len);
+        break;
+      }
+      n += len;
+      hint = start + len;
+    }
+    return n;
+  }
+
+  // each indirect block goes right before the data it maps
+  bmap_cursor map(bm, ino);
+  map.hint = prev ? prev + 1 : 0;
+  while (n < to && map.prepare(n)) {
+    blockid_t start =
+        bm->alloc_extent(MIN(to - n, map.run_limit(n)), map.hint, len);
+    if (start == 0) break;
+    for (uint32_t i = 0; i < len; i++) map.set(n + i, start + i);
+    n += len;
+    map.hint = start + len;
+  }
+  return n;
+}
+
+// Move the inline contents of ino out to a block of their own, for a file
+// about to outgrow the inode. Returns false, leaving the file inline, if the
+// disk is full.
+bool inode_manager::promote_inline(inode_t *ino) {
+  char tmp[BLOCK_SIZE] = {0};
+  memcpy(tmp, ino->data, INLINE_MAX);
+  bzero(ino->data, INLINE_MAX);
+  ino->flags = use_extents ? INODE_EXTENTS : 0;
+  if (write_blocks(ino, 0, 1, tmp) == 1) return true;
+
+  free_blocks(ino, 0);
+  ino->flags = INODE_INLINE;
+  memcpy(ino->data, tmp, INLINE_MAX);
+  return false;
+}
+
+// Free every block of the file from block `from` on, including indirect
+// blocks that no longer map anything, and clear their map entries.
+void inode_manager::free_blocks(inode_t *ino, uint32_t from) {
+  if (ino->flags & INODE_INLINE) {
+    if (from == 0) bzero(ino->data, INLINE_MAX);
+    return;
+  }
+  if (ino->flags & INODE_EXTENTS) {
+    extent_tree(bm, ino).truncate(from);
+    return;
+  }
+  for (uint32_t i = from; i < NDIRECT; i++) {
+    if (ino->blocks[i]) bm->free_block(ino->blocks[i]);
+    ino->blocks[i] = 0;
+  }
+  uint32_t base = NDIRECT;
+  uint32_t span = NINDIRECT;
+  for (int depth = 1; depth <= 3; depth++) {
+    blockid_t &id = ino->blocks[NDIRECT + depth - 1];
+    if (id && free_indirect(id, depth, base, from)) {
+      bm->free_block(id);
+      id = 0;
+    }
+    base += span;
+    span *= NINDIRECT;
+  }
+}
+
+// Free what indirect block id maps at or past block `from`; depth 1 maps
+// data blocks directly, and its first entry maps block base. Returns true if
+// the indirect block itself is no longer needed.
+bool inode_manager::free_indirect(blockid_t id, int depth, uint32_t base,
+                                  uint32_t from) {
+  uint32_t span = 1;
+  for (int d = 1; d < depth; d++) span *= NINDIRECT;
+
+  block_buf *b = bm->pin_block(id);
+  blockid_t *e = (blockid_t *)b->data;
+  bool changed = false;
+  for (uint32_t i = 0; i < NINDIRECT; i++) {
+    uint32_t child = base + i * span;
+    if (child + span <= from || e[i] == 0) continue;
+    if (depth == 1 || free_indirect(e[i], depth - 1, child, from)) {
+      bm->free_block(e[i]);
+      e[i] = 0;
+      changed = true;
+    }
+  }
+  bm->unpin_block(b, changed);
+  return base >= from;
+}
+
+// Fill iov with blocks [first, first + count) of the file, to be transferred
+// from or to buf. Extent files are looked up once per extent.
+void inode_manager::map_blocks(inode_t *ino, uint32_t first, uint32_t count,
+                               char *buf, std::vector<block_iov> &iov) {
+  iov.resize(count);
+  if (ino->flags & INODE_EXTENTS) {
+    extent_tree tree(bm, ino);
+    for (uint32_t i = 0; i < count;) {
+      uint32_t len;
+      blockid_t id = tree.lookup(first + i, len);
+      for (uint32_t j = 0; j < len && i < count; j++, i++) {
+        iov[i].id = id ? id + j : 0;
+        iov[i].buf = buf + BLOCK_SIZE * i;
+      }
+    }
+    return;
+  }
+  bmap_cursor map(bm, ino);
+  for (uint32_t i = 0; i < count; i++) {
+    iov[i].id = map.get(first + i);
+    iov[i].buf = buf + BLOCK_SIZE * i;
+  }
+}
+
+// Whether the block at p is all zeros. ORing whole words without an early
+// exit lets the compiler vectorize the loop.
+static bool zero_block(const char *p) {
+  uint64_t acc = 0;
+  for (uint32_t i = 0; i < BLOCK_SIZE; i += sizeof(uint64_t)) {
+    uint64_t w;
+    memcpy(&w, p + i, sizeof(w));
+    acc |= w;
+  }
+  return acc == 0;
+}
+
+// Drop the holes from iov, so only mapped blocks reach the block layer.
+static void skip_holes(std::vector<block_iov> &iov) {
+  uint32_t k = 0;
+  for (uint32_t i = 0; i < iov.size(); i++)
+    if (iov[i].id) iov[k++] = iov[i];
+  iov.resize(k);
+}
+
+// Read blocks [first, first + count) of the file into buf with one batch.
+// Holes read as zeros.
+void inode_manager::read_blocks(inode_t *ino, uint32_t first, uint32_t count,
+                                char *buf) {
+  std::vector<block_iov> iov;
+  map_blocks(ino, first, count, buf, iov);
+  for (const block_iov &v : iov)
+    if (v.id == 0) bzero(v.buf, BLOCK_SIZE);
+  skip_holes(iov);
+  bm->read_blocks(iov);
+}
+
+// Write blocks [first, first + count) of the file from buf with one batch.
+// Holes only get a block if their data isn't all zeros. Returns the number
+// of blocks written, which is short of count only when the disk is full.
+uint32_t inode_manager::write_blocks(inode_t *ino, uint32_t first,
+                                     uint32_t count, const char *buf) {
+  std::vector<block_iov> iov;
+  map_blocks(ino, first, count, (char *)buf, iov);
+  bool allocated = false;
+  for (uint32_t i = 0; i < count;) {
+    if (iov[i].id || zero_block(iov[i].buf)) {
+      i++;
+      continue;
+    }
+    uint32_t j = i + 1;
+    while (j < count && !iov[j].id && !zero_block(iov[j].buf)) j++;
+    uint32_t end = alloc_blocks(ino, first + i, first + j);
+    allocated = true;
+    if (end < first + j) {
+      count = end - first;
+      break;
+    }
+    i = j;
+  }
+  if (allocated) map_blocks(ino, first, count, (char *)buf, iov);
+  iov.resize(count);
+  skip_holes(iov);
+  bm->write_blocks(iov);
+  return count;
 }
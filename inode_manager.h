@@ -5,7 +5,13 @@
 
 #include <stdint.h>
 
-#include <map>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "extent_protocol.h"
 
@@ -17,48 +23,146 @@
 
 typedef uint32_t blockid_t;
 
+// One block of a vectored transfer: block id is read into, or written from,
+// buf. Like struct iovec, buf is not const even when it is only read from.
+struct block_iov {
+  blockid_t id;
+  char *buf;
+};
+
 // disk layer -----------------------------------------
 
+// The disk is a DISK_SIZE image file mapped into memory, so block accesses
+// are page-cache accesses and the contents survive a restart. Without an
+// image (or if it cannot be mapped) it falls back to anonymous memory.
 class disk {
  private:
-  unsigned char blocks[BLOCK_NUM][BLOCK_SIZE];
+  unsigned char (*blocks)[BLOCK_SIZE];
+  int fd;
+  // where write_atomic() puts the blocks before they go into the image
+  std::string journal;
+
+  void replay_journal();
 
  public:
-  disk();
+  disk(const char *image = NULL);
+  ~disk();
   void read_block(uint32_t id, char *buf);
   void write_block(uint32_t id, const char *buf);
+  void read_blocks(const block_iov *iov, int n);
+  void write_blocks(const block_iov *iov, int n);
+  // Write the blocks so that a crash leaves the image with all of them or
+  // none: they are journaled first, and the journal is finished by the next
+  // disk() if the copy into the image is cut short.
+  void write_atomic(const block_iov *iov, int n);
+  void sync();
 };
 
 // block layer -----------------------------------------
 
+#define CHFS_MAGIC 0x43484653
+// Bumped whenever the on-disk layout changes, so old images get reformatted.
+#define CHFS_VERSION 9
+
+// Block containing the superblock
+#define SBLOCK 1
+
+// 64-bit words in the free block bitmap
+#define BITMAP_WORDS (BLOCK_NUM / 64)
+
 typedef struct superblock {
+  uint32_t magic;
+  uint32_t version;
   uint32_t size;
   uint32_t nblocks;
   uint32_t ninodes;
+  // txid of the last commit the image reflects
+  uint64_t txid;
 } superblock_t;
 
+// Buffers in the block cache
+#define BCACHE_SIZE 1024
+
+// A cached block. While pinned it stays in the cache and data can be used in
+// place; when dirty it reaches the disk at the next sync(). The header
+// is guarded by the cache lock. The data is not: callers hold the lock of
+// whatever owns the block (the inode it belongs to, or the allocator).
+struct block_buf {
+  blockid_t id;
+  bool valid;
+  bool dirty;
+  bool ref;  // CLOCK reference bit
+  int pins;
+  char data[BLOCK_SIZE];
+};
+
 class block_manager {
  private:
   disk *d;
-  std::map<uint32_t, int> using_blocks;
+  // guards cached, held, hand, the buffer headers and sb
+  std::mutex cache_mtx;
+  block_buf cache[BCACHE_SIZE];
+  std::unordered_map<blockid_t, block_buf *> cached;
+  uint32_t hand;  // CLOCK hand
+  // Dirty blocks evicted from the cache, and blocks written around it. The
+  // disk only changes in sync(), so that after a crash it is just as the
+  // last sync left it; until then they wait here.
+  std::unordered_map<blockid_t, std::string> held;
+  // One bit per block, set while its cached or held copy is newer than the
+  // disk. Every other block reads the same from the disk, without the cache
+  // lock.
+  std::atomic<uint64_t> stale[BITMAP_WORDS];
+  // guards bitmap, next_word and nfree
+  std::mutex alloc_mtx;
+  // In-memory copy of the free block bitmap in the BBLOCK region, one bit
+  // per block, set if the block is in use. Searched a word at a time.
+  uint64_t bitmap[BITMAP_WORDS];
+  // word the next search starts from
+  uint32_t next_word;
+
+  void format();
+  void write_bitmap(uint32_t id);
+  bool is_free(blockid_t id) {
+    return !(bitmap[id / 64] & (1ULL << (id % 64)));
+  }
+  blockid_t find_run(uint32_t count);
+  block_buf *lookup_buf(blockid_t id, bool load);
+  block_buf *evict_buf();
+  void set_stale(blockid_t id, bool on);
+  bool is_stale(blockid_t id) {
+    return stale[id / 64].load(std::memory_order_acquire) &
+           (1ULL << (id % 64));
+  }
 
  public:
-  block_manager();
+  block_manager(const char *image = NULL);
   struct superblock sb;
+  // true if an image was reopened instead of formatted; it holds every
+  // transaction up to sb.txid
+  bool mounted;
+  uint32_t nfree;
 
   uint32_t alloc_block();
+  blockid_t alloc_extent(uint32_t count, blockid_t hint, uint32_t &len);
   void free_block(uint32_t id);
+  void free_extent(blockid_t start, uint32_t len);
   void read_block(uint32_t id, char *buf);
   void write_block(uint32_t id, const char *buf);
+  void read_blocks(const std::vector<block_iov> &iov);
+  void write_blocks(const std::vector<block_iov> &iov);
+  // Pin block id in the cache; pass load = false if the caller is going to
+  // overwrite all of it. Every pin must be matched by an unpin.
+  block_buf *pin_block(blockid_t id, bool load = true);
+  void unpin_block(block_buf *b, bool dirty);
+  void sync(uint64_t txid);
 };
 
 // inode layer -----------------------------------------
 
-#define INODE_NUM 1024
+#define INODE_NUM 4096
 
 // Inodes per block.
-#define IPB 1
-//(BLOCK_SIZE / sizeof(struct inode))
+#define IPB (BLOCK_SIZE / sizeof(struct inode))
 
 // Block containing inode i
 #define IBLOCK(i, nblocks) ((nblocks) / BPB + (i) / IPB + 3)
@@ -69,37 +173,205 @@ class block_manager {
 // Block containing bit for block b
 #define BBLOCK(b) ((b) / BPB + 2)
 
-#define NDIRECT 100
+// Block holding the inode bitmap, between the block bitmap and inode table
+#define IBMBLOCK(nblocks) ((nblocks) / BPB + 2)
+
+// On-disk inode size; a power of two so inodes never straddle blocks.
+#define INODE_SIZE 128
+
+#define NDIRECT 23
 #define NINDIRECT (BLOCK_SIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define NDINDIRECT (NINDIRECT * NINDIRECT)
+#define NTINDIRECT (NDINDIRECT * NINDIRECT)
+#define MAXFILE (NDIRECT + NINDIRECT + NDINDIRECT + NTINDIRECT)
+
+// Maps the run of len logical blocks starting at lblk to the run of disk
+// blocks starting at pblk. In interior nodes of an extent tree pblk is the
+// child node holding the extents from lblk on, and len is unused.
+struct extent {
+  uint32_t lblk;
+  blockid_t pblk;
+  uint32_t len;
+};
+
+struct extent_header {
+  uint16_t count;  // records in use
+  uint16_t depth;  // 0 for a leaf
+};
+
+// Extent records in the inode itself, and in a tree block after its header.
+#define EXT_ROOT 8
+#define EXT_PER_BLOCK ((BLOCK_SIZE - sizeof(extent_header)) / sizeof(extent))
+
+struct extent_root {
+  extent_header hdr;
+  extent e[EXT_ROOT];
+};
+
+// inode flags
+#define INODE_EXTENTS 0x1  // blocks are mapped by ext instead of blocks[]
+#define INODE_INLINE 0x2   // the contents are in data; there are no blocks
+
+// Bytes of file contents that fit in the inode in place of the block map
+#define INLINE_MAX (sizeof(blockid_t) * (NDIRECT + 3))
 
 typedef struct inode {
   short type;
+  unsigned short flags;
   unsigned int size;
   unsigned int atime;
   unsigned int mtime;
   unsigned int ctime;
-  // number of direct blocks: NDIRECT
-  // number of indrect blocks: 1
-  // total number of blocks a inode can have: MAXFILE(NDIRECT + NINDIRECT)
-  blockid_t blocks[NDIRECT + 1];  // Data block addresses
+  // bumped each time the inum is reused; kept while the inode is free
+  unsigned int gen;
+  union {
+    // number of direct blocks: NDIRECT
+    // then one single, one double and one triple indirect block
+    // total number of blocks a inode can have: MAXFILE
+    blockid_t blocks[NDIRECT + 3];  // Data block addresses, 0 for a hole
+    // root of the extent tree
+    struct extent_root ext;
+    // contents of a small file, zero past size
+    char data[INLINE_MAX];
+  };
 } inode_t;
 
+static_assert(sizeof(inode_t) == INODE_SIZE, "inode_t must be INODE_SIZE");
+static_assert(sizeof(extent_root) <= sizeof(((inode_t *)0)->blocks),
+              "the extent root must fit in place of the block pointers");
+
+// Inodes kept in the inode cache
+#define ICACHE_SIZE 1024
+
+// Reader/writer locks for inodes; inum i uses inode_locks[i % ILOCKS]
+#define ILOCKS 64
+
+// In-memory copy of an inode. Entries with references are never evicted;
+// dirty ones are written back on eviction or sync().
+struct cached_inode {
+  inode_t ino;
+  int ref;
+  bool dirty;
+};
+
+// Walks the block map of one inode. The indirect blocks on the path to the
+// last block looked up stay pinned until the cursor is destroyed, so a
+// sequential pass reads each indirect block once instead of once per block.
+class bmap_cursor {
+ private:
+  block_manager *bm;
+  inode_t *ino;
+  block_buf *path[3];
+  bool dirty[3];
+
+  void load(int depth, blockid_t id, bool fresh);
+  blockid_t *entry(uint32_t n, bool alloc);
+
+ public:
+  // where to put the next indirect block set() or prepare() has to allocate
+  blockid_t hint;
+
+  bmap_cursor(block_manager *bm, inode_t *ino);
+  ~bmap_cursor();
+  blockid_t get(uint32_t n);
+  // allocate the indirect blocks needed to map block n; false if out of space
+  bool prepare(uint32_t n);
+  void set(uint32_t n, blockid_t id);
+  // blocks from n up to the end of the map block holding the entry of n
+  uint32_t run_limit(uint32_t n);
+};
+
+// B+tree of extents rooted in an INODE_EXTENTS inode. Up to EXT_ROOT extents
+// live in the inode; beyond that the root moves into a block and the inode
+// keeps an index to it. A contiguous file maps with a single extent however
+// large it is, so lookups and frees work on whole runs instead of blocks.
+// Blocks no extent covers are holes.
+class extent_tree {
+ private:
+  block_manager *bm;
+  inode_t *ino;
+  // blocks allocated up front for the splits of one insert
+  std::vector<blockid_t> spare;
+
+  uint32_t split_cost(const extent &x);
+  bool insert_node(extent_header *h, uint32_t max, const extent &x,
+                   bool &split, extent &sib);
+  bool add_record(extent_header *h, uint32_t max, uint32_t i, const extent &x,
+                  bool &split, extent &sib);
+  bool truncate_node(extent_header *h, uint32_t from);
+
+ public:
+  extent_tree(block_manager *bm, inode_t *ino) : bm(bm), ino(ino) {}
+  // disk block of block n, or 0 for a hole; len is set to the number of
+  // blocks from n on that are mapped contiguously (or are all hole)
+  blockid_t lookup(uint32_t n, uint32_t &len);
+  // map blocks [lblk, lblk + len), which must be unmapped; false if a tree
+  // block couldn't be allocated
+  bool insert(uint32_t lblk, blockid_t pblk, uint32_t len);
+  // free every block from block `from` on
+  void truncate(uint32_t from);
+};
+
+static_assert(INODE_NUM % 64 == 0 && INODE_NUM <= BPB,
+              "the inode bitmap must fit in one block");
+
 class inode_manager {
  private:
   block_manager *bm;
+  // in-memory copy of the inode bitmap; bit inum - 1 is set if the inode is
+  // in use, as there is no inode 0
+  uint64_t inode_bitmap[INODE_NUM / 64];
+  // free inums in allocation order; may hold inums since taken by pos
+  std::deque<uint32_t> free_inums;
+  std::mutex ialloc_mtx;
+  // Held shared by reads of an inode and exclusive by changes to it, across
+  // the whole operation; the blocks it maps are covered too.
+  std::shared_mutex inode_locks[ILOCKS];
+  // guards icache; cached inodes with references are used without it
+  std::mutex icache_mtx;
+  std::unordered_map<uint32_t, cached_inode> icache;
+  cached_inode *lookup_inode(uint32_t inum);
+  void write_inode(uint32_t inum, const inode_t *ino);
+  void flush_inodes();
   struct inode *get_inode(uint32_t inum);
   void put_inode(uint32_t inum, struct inode *ino);
+  void release_inode(uint32_t inum);
+  bool inode_used(uint32_t inum) {
+    return inode_bitmap[(inum - 1) / 64] & (1ULL << ((inum - 1) % 64));
+  }
+  void mark_inode(uint32_t inum, bool used);
+  std::shared_mutex &inode_lock(uint32_t inum) {
+    return inode_locks[inum % ILOCKS];
+  }
   blockid_t get_nth_block(inode_t *ino, uint32_t n);
-  void alloc_nth_block(inode_t *ino, uint32_t n);
-  void free_nth_block(inode_t *ino, uint32_t n);
+  uint32_t alloc_blocks(inode_t *ino, uint32_t from, uint32_t to);
+  void free_blocks(inode_t *ino, uint32_t from);
+  bool touch_atime(inode_t *ino);
+  bool promote_inline(inode_t *ino);
+  bool free_indirect(blockid_t id, int depth, uint32_t base, uint32_t from);
+  void map_blocks(inode_t *ino, uint32_t first, uint32_t count, char *buf,
+                  std::vector<block_iov> &iov);
+  void read_blocks(inode_t *ino, uint32_t first, uint32_t count, char *buf);
+  uint32_t write_blocks(inode_t *ino, uint32_t first, uint32_t count,
+                        const char *buf);
 
  public:
-  inode_manager();
+  inode_manager(const char *image = NULL);
+  // whether files that outgrow the inode map their blocks with extents
+  bool use_extents;
+  extent_protocol::atime_policy atime_policy;
+  bool mounted() { return bm->mounted; }
+  uint64_t mounted_txid() { return bm->sb.txid; }
+  void sync(uint64_t txid);
   uint32_t alloc_inode(uint32_t type, uint32_t pos = 0);
   void free_inode(uint32_t inum);
+  // let alloc_inode hand out a freed inum again
+  void recycle_inode(uint32_t inum);
   void read_file(uint32_t inum, char **buf, int *size);
   void write_file(uint32_t inum, const char *buf, int size);
+  int read_range(uint32_t inum, unsigned int off, unsigned int len, char *buf);
+  int write_range(uint32_t inum, unsigned int off, const char *buf,
+                  unsigned int len);
   void remove_file(uint32_t inum);
   void get_attr(uint32_t inum, extent_protocol::attr &a);
 };
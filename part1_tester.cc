@@ -32,11 +32,16 @@
  */
 
 #include "extent_client.h"
+#include "dir_format.h"
+#include <limits.h>
 #include <stdio.h>
+#include <map>
+#include <set>
 
 #define FILE_NUM 50
 #define LARGE_FILE_SIZE_MIN 512 * 10
 #define LARGE_FILE_SIZE_MAX 512 * 200
+#define DIR_NAME_NUM 1500
 
 #define iprint(msg) \
     printf("[TEST_ERROR]: %s\n", msg);
@@ -262,6 +267,268 @@ int test_remove()
     return 0;
 }
 
+// After the same 220 bytes maczf and slbpp hash alike under FNV-1a, and
+// from there so do numzf and tplpp, twice over; each of the 8 ways to
+// choose gives the same hash. The names are long enough that no leaf holds
+// more than 4 of them.
+std::string collide_name(int i)
+{
+    const char *first[2] = {"maczf", "slbpp"};
+    const char *rest[2] = {"numzf", "tplpp"};
+    return std::string(220, 'c') + first[i & 1] + rest[(i >> 1) & 1] + rest[(i >> 2) & 1];
+}
+
+dir_header dir_hdr(const std::string &d)
+{
+    dir_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(&hdr, d.data(), std::min(d.size(), sizeof(hdr)));
+    return hdr;
+}
+
+// every name in want is found, and listed once, in hash order, whether
+// the listing is taken at once or a few entries at a time
+int check_dir(std::string &d, std::map<std::string, uint32_t> &want)
+{
+    string_dir_store ds(d);
+    dir_index di(&ds);
+    std::map<std::string, uint32_t>::iterator it;
+    for (it = want.begin(); it != want.end(); it++)
+    {
+        uint32_t inum = 0;
+        if (di.lookup(it->first.c_str(), inum) != extent_protocol::OK || inum != it->second)
+        {
+            printf("[TEST_ERROR]: error dir lookup %s\n", it->first.c_str());
+            return 1;
+        }
+    }
+
+    std::list<dir_entry> all, paged;
+    if (di.list(all) != extent_protocol::OK || all.size() != want.size())
+    {
+        iprint("error dir list, wrong number of entries");
+        return 2;
+    }
+    std::set<std::string> seen;
+    uint64_t last = 0;
+    for (std::list<dir_entry>::iterator e = all.begin(); e != all.end(); e++)
+    {
+        it = want.find(e->name);
+        if (it == want.end() || it->second != e->inum || !seen.insert(e->name).second)
+        {
+            printf("[TEST_ERROR]: error dir list, unexpected %s\n", e->name.c_str());
+            return 3;
+        }
+        if (e->cursor <= last)
+        {
+            iprint("error dir list, not in hash order");
+            return 4;
+        }
+        last = e->cursor;
+    }
+
+    uint64_t cursor = 0;
+    for (;;)
+    {
+        std::list<dir_entry> batch;
+        if (di.list(cursor, 7, batch) != extent_protocol::OK)
+        {
+            iprint("error dir list from a cursor, return not OK");
+            return 5;
+        }
+        if (batch.empty())
+            break;
+        cursor = batch.back().cursor;
+        paged.splice(paged.end(), batch);
+        if (paged.size() > all.size())
+        {
+            iprint("error dir list from a cursor, entries repeated");
+            return 6;
+        }
+    }
+    std::list<dir_entry>::iterator a = all.begin(), b = paged.begin();
+    for (; a != all.end() && b != paged.end(); a++, b++)
+        if (a->name != b->name)
+            break;
+    if (a != all.end() || b != paged.end())
+    {
+        iprint("error dir list, paged listing differs");
+        return 7;
+    }
+    return 0;
+}
+
+int test_dir_index()
+{
+    int i, r;
+    uint32_t inum;
+    char name[256];
+
+    printf("========== begin test dir index ==========\n");
+
+    // leaf splits, then removes and adds again
+    std::string d1;
+    string_dir_store ds1(d1);
+    dir_index di1(&ds1);
+    std::map<std::string, uint32_t> want;
+    for (i = 0; i < 300; i++)
+    {
+        sprintf(name, "file%d", i);
+        if (di1.add(name, i + 2) != extent_protocol::OK)
+        {
+            iprint("error dir add, return not OK");
+            return 1;
+        }
+        want[name] = i + 2;
+    }
+    if (dir_hdr(d1).npages < 3 || dir_hdr(d1).depth != 1)
+    {
+        iprint("error dir add, leaves did not split");
+        return 2;
+    }
+    if (di1.add("file7", 1000) != extent_protocol::EXIST)
+    {
+        iprint("error dir add, duplicate name not refused");
+        return 3;
+    }
+    if ((r = check_dir(d1, want)) != 0)
+        return 10 + r;
+    for (i = 0; i < 300; i += 3)
+    {
+        sprintf(name, "file%d", i);
+        if (di1.remove(name, inum) != extent_protocol::OK || inum != (uint32_t)i + 2)
+        {
+            iprint("error dir remove, return not OK");
+            return 4;
+        }
+        if (di1.lookup(name, inum) != extent_protocol::NOENT)
+        {
+            iprint("error dir remove, name still found");
+            return 5;
+        }
+        want.erase(name);
+    }
+    if ((r = check_dir(d1, want)) != 0)
+        return 20 + r;
+    for (i = 0; i < 300; i += 6)
+    {
+        sprintf(name, "file%d", i);
+        if (di1.add(name, i + 5000) != extent_protocol::OK)
+        {
+            iprint("error dir add after remove, return not OK");
+            return 6;
+        }
+        want[name] = i + 5000;
+    }
+    if ((r = check_dir(d1, want)) != 0)
+        return 30 + r;
+
+    // enough long names that the root of the index nodes splits too
+    std::string d2;
+    string_dir_store ds2(d2);
+    dir_index di2(&ds2);
+    want.clear();
+    for (i = 0; i < DIR_NAME_NUM; i++)
+    {
+        std::string n = std::string(200, 'l') + std::to_string(i);
+        if (di2.add(n.c_str(), i + 2) != extent_protocol::OK)
+        {
+            iprint("error dir add long name, return not OK");
+            return 7;
+        }
+        want[n] = i + 2;
+    }
+    if (dir_hdr(d2).depth < 2)
+    {
+        iprint("error dir add, root did not grow");
+        return 8;
+    }
+    if ((r = check_dir(d2, want)) != 0)
+        return 40 + r;
+
+    // names of one hash, more than a leaf holds, among others
+    std::string d3;
+    string_dir_store ds3(d3);
+    dir_index di3(&ds3);
+    want.clear();
+    for (i = 0; i < 64; i++)
+    {
+        sprintf(name, "f%d", i);
+        std::string n = i % 8 == 4 ? collide_name(i / 8) : std::string(name);
+        if (di3.add(n.c_str(), i + 2) != extent_protocol::OK)
+        {
+            iprint("error dir add colliding name, return not OK");
+            return 9;
+        }
+        want[n] = i + 2;
+    }
+    if ((r = check_dir(d3, want)) != 0)
+        return 50 + r;
+    std::string base = d3;
+
+    // removing one of them leaves the rest found, on either side of a split
+    int order[8] = {5, 0, 7, 2, 6, 1, 3, 4};
+    for (i = 0; i < 8; i++)
+    {
+        std::string n = collide_name(order[i]);
+        if (di3.remove(n.c_str(), inum) != extent_protocol::OK || inum != (uint32_t)order[i] * 8 + 6)
+        {
+            iprint("error dir remove colliding name, return not OK");
+            return 10;
+        }
+        want.erase(n);
+        if (di3.lookup(n.c_str(), inum) != extent_protocol::NOENT)
+        {
+            iprint("error dir remove colliding name, name still found");
+            return 11;
+        }
+        if ((r = check_dir(d3, want)) != 0)
+            return 60 + r;
+    }
+
+    // a listing resumed from any cursor, after the leaves around it split,
+    // goes on with just the entries it had not returned
+    std::list<dir_entry> before;
+    string_dir_store base_ds(base);
+    dir_index(&base_ds).list(before);
+    int pos = 0;
+    for (std::list<dir_entry>::iterator c = before.begin(); c != before.end(); c++, pos++)
+    {
+        std::string d4 = base;
+        string_dir_store ds4(d4);
+        dir_index di4(&ds4);
+        for (i = 0; i < 100; i++)
+        {
+            sprintf(name, "g%d", i);
+            di4.add(name, i + 1000);
+        }
+        std::list<dir_entry> after;
+        if (di4.list(c->cursor, UINT_MAX, after) != extent_protocol::OK)
+        {
+            iprint("error dir list from a cursor, return not OK");
+            return 12;
+        }
+        std::set<std::string> rest;
+        for (std::list<dir_entry>::iterator e = after.begin(); e != after.end(); e++)
+            if (e->name[0] != 'g' && !rest.insert(e->name).second)
+            {
+                iprint("error dir list from a cursor, entry repeated");
+                return 13;
+            }
+        std::list<dir_entry>::iterator e = before.begin();
+        for (int k = 0; e != before.end(); e++, k++)
+            if ((k > pos) != (rest.count(e->name) == 1))
+            {
+                printf("[TEST_ERROR]: error dir list from cursor %d, %s %s\n", pos,
+                       e->name.substr(0, 20).c_str(), k > pos ? "skipped" : "repeated");
+                return 14;
+            }
+    }
+
+    printf("========== pass test dir index ==========\n");
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     if (argc != 1)
@@ -280,6 +547,8 @@ int main(int argc, char *argv[])
         goto test_finish;
     if (test_indirect() != 0)
         goto test_finish;
+    if (test_dir_index() != 0)
+        goto test_finish;
 
 test_finish:
     printf("---------------------------------\n");
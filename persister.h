@@ -2,9 +2,14 @@
 #define persister_h
 
 #include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <map>
 #include <mutex>
 #include <vector>
 
@@ -35,6 +40,9 @@ enum cmd_type {
   CMD_GET,
   CMD_GETATTR,
   CMD_REMOVE,
+  CMD_WRITE,
+  CMD_DIR_ADD,
+  CMD_DIR_REMOVE,
   CMD_DEFAULT
 };
 class chfs_command {
@@ -137,6 +145,8 @@ class chfs_command_put : public chfs_command {
     in.read(reinterpret_cast<char*>(&txid), sizeof(txid));
     in.read(reinterpret_cast<char*>(&inum), sizeof(inum));
     in.read(reinterpret_cast<char*>(&size), sizeof(size));
+    // 日志末尾可能只写了一半
+    if (!in) return;
     std::cout << "txid, inum, size: " << txid << " " << inum << " " << size
               << std::endl;
     char* ch = new char[size + 1];
@@ -145,7 +155,7 @@ class chfs_command_put : public chfs_command {
     // 非常关键 中间可能有'\0' ，因为offset可能大于size
     str = std::string(ch, size);
     // assert(str.size() == size);
-    delete ch;
+    delete[] ch;
   }
   void print() {
     printf("put  txid=%lld inum =%d size=%d\n", txid, inum, size);
@@ -175,6 +185,123 @@ class chfs_command_remove : public chfs_command {
 
   void print() {}
 };
+// 写入文件的一段: off处的size个字节
+class chfs_command_write : public chfs_command {
+ public:
+  uint32_t inum, off, size;
+  std::string str;
+  chfs_command_write() : chfs_command(CMD_WRITE) {}
+  chfs_command_write(txid_t id, uint32_t inum_, uint32_t off_,
+                     const std::string& s)
+      : chfs_command(id, CMD_WRITE),
+        inum(inum_),
+        off(off_),
+        size(s.size()),
+        str(s) {}
+  virtual ~chfs_command_write() = default;
+
+  void save_log(std::ofstream& out) {
+    out.write(reinterpret_cast<char*>(&cmdTy), sizeof(cmdTy));
+    out.write(reinterpret_cast<char*>(&txid), sizeof(txid));
+    out.write(reinterpret_cast<char*>(&inum), sizeof(inum));
+    out.write(reinterpret_cast<char*>(&off), sizeof(off));
+    out.write(reinterpret_cast<char*>(&size), sizeof(size));
+    assert(size == str.size());
+    out.write(str.c_str(), size);
+  }
+
+  void read_log(std::ifstream& in) {
+    in.read(reinterpret_cast<char*>(&txid), sizeof(txid));
+    in.read(reinterpret_cast<char*>(&inum), sizeof(inum));
+    in.read(reinterpret_cast<char*>(&off), sizeof(off));
+    in.read(reinterpret_cast<char*>(&size), sizeof(size));
+    if (!in) return;
+    str.resize(size);
+    in.read(&str[0], size);
+  }
+
+  void print() {
+    printf("write txid=%lld inum=%d off=%u size=%u\n", txid, inum, off, size);
+  }
+};
+
+// 目录parent中加入name -> inum
+class chfs_command_dir_add : public chfs_command {
+ public:
+  uint32_t parent, inum;
+  std::string name;
+  chfs_command_dir_add() : chfs_command(CMD_DIR_ADD) {}
+  chfs_command_dir_add(txid_t id, uint32_t parent_, const std::string& name_,
+                       uint32_t inum_)
+      : chfs_command(id, CMD_DIR_ADD),
+        parent(parent_),
+        inum(inum_),
+        name(name_) {}
+  virtual ~chfs_command_dir_add() = default;
+
+  void save_log(std::ofstream& out) {
+    uint32_t len = name.size();
+    out.write(reinterpret_cast<char*>(&cmdTy), sizeof(cmdTy));
+    out.write(reinterpret_cast<char*>(&txid), sizeof(txid));
+    out.write(reinterpret_cast<char*>(&parent), sizeof(parent));
+    out.write(reinterpret_cast<char*>(&inum), sizeof(inum));
+    out.write(reinterpret_cast<char*>(&len), sizeof(len));
+    out.write(name.c_str(), len);
+  }
+
+  void read_log(std::ifstream& in) {
+    uint32_t len;
+    in.read(reinterpret_cast<char*>(&txid), sizeof(txid));
+    in.read(reinterpret_cast<char*>(&parent), sizeof(parent));
+    in.read(reinterpret_cast<char*>(&inum), sizeof(inum));
+    in.read(reinterpret_cast<char*>(&len), sizeof(len));
+    if (!in) return;
+    name.resize(len);
+    in.read(&name[0], len);
+  }
+
+  void print() {
+    printf("dir_add txid=%lld parent=%u name=%s inum=%u\n", txid, parent,
+           name.c_str(), inum);
+  }
+};
+
+// 从目录parent中删去name
+class chfs_command_dir_remove : public chfs_command {
+ public:
+  uint32_t parent;
+  std::string name;
+  chfs_command_dir_remove() : chfs_command(CMD_DIR_REMOVE) {}
+  chfs_command_dir_remove(txid_t id, uint32_t parent_,
+                          const std::string& name_)
+      : chfs_command(id, CMD_DIR_REMOVE), parent(parent_), name(name_) {}
+  virtual ~chfs_command_dir_remove() = default;
+
+  void save_log(std::ofstream& out) {
+    uint32_t len = name.size();
+    out.write(reinterpret_cast<char*>(&cmdTy), sizeof(cmdTy));
+    out.write(reinterpret_cast<char*>(&txid), sizeof(txid));
+    out.write(reinterpret_cast<char*>(&parent), sizeof(parent));
+    out.write(reinterpret_cast<char*>(&len), sizeof(len));
+    out.write(name.c_str(), len);
+  }
+
+  void read_log(std::ifstream& in) {
+    uint32_t len;
+    in.read(reinterpret_cast<char*>(&txid), sizeof(txid));
+    in.read(reinterpret_cast<char*>(&parent), sizeof(parent));
+    in.read(reinterpret_cast<char*>(&len), sizeof(len));
+    if (!in) return;
+    name.resize(len);
+    in.read(&name[0], len);
+  }
+
+  void print() {
+    printf("dir_remove txid=%lld parent=%u name=%s\n", txid, parent,
+           name.c_str());
+  }
+};
+
 // 定义一个指针类型
 typedef chfs_command* chfs_command_ptr;
 
@@ -191,167 +318,142 @@ typedef chfs_command* chfs_command_ptr;
 // 为了不重定义只能放里面了
 class chfs_persister {
  public:
-  // restored log data
-  std::vector<chfs_command*> log_entries;
-  chfs_command_create* checkpoint_create[INODE_NUM + 5];
-  chfs_command_put* checkpoint_put[INODE_NUM + 5];
+  // the newest transaction seen in the log, committed or not
+  txid_t last_txid = 0;
 
   chfs_persister(const std::string& dir) {
     // DO NOT change the file names here
     file_dir = dir;
-    file_path_checkpoint = file_dir + "/checkpoint.bin";
     file_path_logfile = file_dir + "/logdata.bin";
-    memset(checkpoint_create, 0, sizeof(checkpoint_create));
-    memset(checkpoint_put, 0, sizeof(checkpoint_put));
+    log_out.open(file_path_logfile, std::ofstream::app | std::ofstream::binary);
   }
   ~chfs_persister() {
     // Your code here for lab2A
-    // 存储checkpoint_entries
-  }
-
-  // 把checkpoint中的数据存储到checkpoint.bin
-  void save_checkpoint() {
-    std::ofstream out(file_path_checkpoint,
-                      std::ofstream::trunc | std::ofstream::binary);
-
-    // 保存checkpoint_entries
-    chfs_command_create* log_create = nullptr;
-    chfs_command_put* log_put = nullptr;
-    for (int i = 1; i <= INODE_NUM; i++) {
-      if ((log_create = checkpoint_create[i]) != nullptr) {
-        // save create log
-        log_create->save_log(out);
-      }
-      assert(i == 1 ||
-             !(log_create == nullptr && checkpoint_put[i] != nullptr));
-      if ((log_put = checkpoint_put[i]) != nullptr) {
-        // put
-        log_put->save_log(out);
-      }
-    }
-    out.close();
   }
 
   // persist data into solid binary file
   // You may modify parameters in these functions
+  // 追加到logdata.bin, commit时交给操作系统(和磁盘镜像一样不等设备写完),
+  // 代价只和事务大小有关; 磁盘镜像sync之前日志就是已提交事务的唯一副本
+  // 日志超过MAX_LOG_SZ后, extent_server在没有未提交事务时sync磁盘镜像,
+  // 再clear_log; 在那之前不再开始新事务(见log_full), 日志只会多出
+  // 已开始的事务写的那些
   void append_log(chfs_command* log) {
     // Your code here for lab2A
-    // 只加入vector 不修改log.bin commit就checkpoint
     printf("append_log type=%d\n", log->cmdTy);
-    log_entries.push_back(log);
-    if (log->cmdTy == CMD_COMMIT) checkpoint();
+    // 事务之外的修改(txid 0)不记日志, 也不会恢复
+    if (log->txid == 0) {
+      delete log;
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mtx);
+    log->save_log(log_out);
+    if (log->cmdTy == CMD_COMMIT) log_out.flush();
+    delete log;
+  }
 
-    // std::ofstream out(file_path_logfile,
-    //                   std::ofstream::app | std::ofstream::binary);
-    // log->save_log(out);
-    // out.close();
+  // 日志是否该checkpoint了
+  bool log_full() {
+    std::lock_guard<std::mutex> lock(mtx);
+    return log_out.tellp() > MAX_LOG_SZ;
   }
 
-  // 把checkpoint_entries中的内容与log_entries中的内容合并
-  void checkpoint() {
-    // Your code here for lab2A
-    printf("checkpoint\n");
-    int sz = log_entries.size();
-    assert(sz >= 2);
-    assert(log_entries[0]->cmdTy == CMD_BEGIN);
-    assert(log_entries[sz - 1]->cmdTy == CMD_COMMIT);
-    uint32_t inum = 0;
-    for (int i = 1; i < sz - 1; i++) {
-      auto log = log_entries[i];
-      switch (log->cmdTy) {
-        case CMD_CREATE: {
-          auto p = dynamic_cast<chfs_command_create*>(log);
-          inum = p->inum;
-          printf("CREATE i=%d inum =%u add=%p\n", i, inum,
-                 checkpoint_create[inum]);
-          assert(checkpoint_create[inum] == nullptr);
-          checkpoint_create[inum] = p;
-          break;
-        }
-        case CMD_PUT: {
-          auto p = dynamic_cast<chfs_command_put*>(log);
-          inum = p->inum;
-          printf("CREATE i=%d inum =%u add=%p\n", i, inum,
-                 checkpoint_put[inum]);
-          assert(inum == 1 || checkpoint_create[inum] != nullptr);
-          if (checkpoint_put[inum] != nullptr) {
-            delete checkpoint_put[inum];
-          }
-          checkpoint_put[inum] = p;
-          break;
-        }
-        case CMD_REMOVE: {
-          auto p = dynamic_cast<chfs_command_remove*>(log);
-          inum = p->inum;
-          assert(checkpoint_create[inum] != nullptr);
-          delete checkpoint_create[inum];
-          if (checkpoint_put[inum] != nullptr) {
-            delete checkpoint_put[inum];
-          }
-          checkpoint_create[inum] = nullptr;
-          checkpoint_put[inum] = nullptr;
-        } break;
-        default:
-          // checkpoint.bin中没有其他类型的log
-          // 包括BEGIN、COMMIT
-          assert(false);
-          break;
-      }
-    }
-    log_entries.clear();
-    save_checkpoint();
+  // 磁盘镜像sync之后调用, 日志里的事务都已在镜像中, 清空日志
+  // 调用时不能有未提交的事务
+  void clear_log() {
+    std::lock_guard<std::mutex> lock(mtx);
+    log_out.close();
+    log_out.open(file_path_logfile,
+                 std::ofstream::trunc | std::ofstream::binary);
   }
 
   // restore data from solid binary file
   // You may modify parameters in these functions
-  // 从文件中恢复log到log_entries中
-  // 因为一个commit就checkpoint 所以没有restore_data的需求
-  void restore_logdata() {
+  // 按commit的顺序把logdata.bin中比since(磁盘镜像的txid)新的已提交事务
+  // 逐条交给redo; 不新于since的是sync之后没来得及清空的, 没提交的丢掉
+  // 末尾写了一半的记录截掉, 之后的日志接在完整的记录后面
+  void restore_logdata(txid_t since,
+                       const std::function<void(chfs_command*)>& redo) {
     // Your code here for lab2A
-  }
-
-  // 开机的时候读取恢复数据
-  // save_checkpoint保证没有重复数据
-  void restore_checkpoint() {
-    // Your code here for lab2A
-    std::ifstream in(file_path_checkpoint, std::ifstream::binary);
+    std::map<txid_t, std::vector<chfs_command*>> log_entries;
+    std::ifstream in(file_path_logfile, std::ifstream::binary);
+    std::streamoff good = 0;
     cmd_type cmdTy;
     while (in.read(reinterpret_cast<char*>(&cmdTy), sizeof(cmdTy))) {
+      chfs_command* log = nullptr;
       switch (cmdTy) {
-        case CMD_CREATE: {
-          auto log = new chfs_command_create();
-          assert(log->cmdTy == CMD_CREATE);
-          log->read_log(in);
-          assert(log->inum > 1 && log->inum <= INODE_NUM);
-          assert(checkpoint_create[log->inum] == nullptr);
-          checkpoint_create[log->inum] = log;
+        case CMD_BEGIN:
+          log = new chfs_command_begin();
+          break;
+        case CMD_COMMIT:
+          log = new chfs_command_commit();
           break;
-        }
-        case CMD_PUT: {
-          auto log = new chfs_command_put();
-          assert(log->cmdTy == CMD_PUT);
-          log->read_log(in);
-          assert(log->inum >= 1 && log->inum <= INODE_NUM);
-          assert(log->inum == 1 || checkpoint_create[log->inum] != nullptr);
-          checkpoint_put[log->inum] = log;
+        case CMD_CREATE:
+          log = new chfs_command_create();
+          break;
+        case CMD_PUT:
+          log = new chfs_command_put();
+          break;
+        case CMD_REMOVE:
+          log = new chfs_command_remove();
+          break;
+        case CMD_WRITE:
+          log = new chfs_command_write();
+          break;
+        case CMD_DIR_ADD:
+          log = new chfs_command_dir_add();
+          break;
+        case CMD_DIR_REMOVE:
+          log = new chfs_command_dir_remove();
           break;
-        }
         default:
-          // checkpoint.bin中没有其他类型的log
-          // 包括BEGIN、COMMIT、REMOVE
-          assert(false);
           break;
       }
-      // log->print();
+      if (log == nullptr) break;
+      log->read_log(in);
+      if (!in) {
+        delete log;
+        break;
+      }
+      good = in.tellg();
+      // 没提交的事务的txid也不能再用
+      if (log->txid > last_txid) last_txid = log->txid;
+      if (log->txid <= since) {
+        delete log;
+        continue;
+      }
+      log_entries[log->txid].push_back(log);
+      if (cmdTy != CMD_COMMIT) continue;
+      std::vector<chfs_command*>& entries = log_entries[log->txid];
+      assert(entries.size() >= 2 && entries[0]->cmdTy == CMD_BEGIN);
+      for (auto p : entries) {
+        redo(p);
+        delete p;
+      }
+      log_entries.erase(log->txid);
     }
     in.close();
+    for (auto& tx : log_entries)
+      for (auto p : tx.second) delete p;
+
+    std::lock_guard<std::mutex> lock(mtx);
+    struct stat st;
+    if (stat(file_path_logfile.c_str(), &st) == 0 && st.st_size > good) {
+      printf("restore_logdata: drop %lld torn bytes\n",
+             (long long)(st.st_size - good));
+      log_out.close();
+      truncate(file_path_logfile.c_str(), good);
+      log_out.open(file_path_logfile,
+                   std::ofstream::app | std::ofstream::binary);
+    }
   }
 
  private:
   std::mutex mtx;
+
   std::string file_dir;
-  std::string file_path_checkpoint;
   std::string file_path_logfile;
+  std::ofstream log_out;
 };
 
 // using chfs_persister = persister<chfs_command*>;
@@ -0,0 +1,147 @@
+#!/bin/bash
+
+##########################################
+#  this file contains:
+#   CRASH TEST: kill -9 chfs_client mid-workload and check what the
+#   restarted one recovers from log/logdata.bin
+###########################################
+
+DIR=chfs1
+LOGFILE=log/logdata.bin
+pwd=`pwd -P`
+TMP=`mktemp -d`
+
+rm log -r >/dev/null 2>&1
+./stop.sh >/dev/null 2>&1
+./start.sh
+
+mounted(){
+    [ `mount | grep "$pwd/chfs1" | grep -v grep | wc -l` -eq 1 ]
+}
+
+fail(){
+    echo "failed CRASH test: $1"
+    rm -rf ${TMP}
+    exit
+}
+
+# kill chfs_client without giving it a chance to sync && wait for it to unmount
+chfs_crash(){
+    echo "===== ChFS Crash ====="
+    killall -9 chfs_client >/dev/null 2>&1
+    ./stop.sh >/dev/null 2>&1
+    while mounted
+    do
+        echo "Wait for ChFS to unmount..."
+        sleep 0.1
+    done
+}
+
+# restart chfs && wait for it to mount
+chfs_restart(){
+    echo "===== ChFS Restart ====="
+    ./start.sh
+    while ! mounted
+    do
+        echo "Wait for ChFS to mount..."
+        sleep 0.1
+    done
+}
+
+# what the workload writes to seq$1
+content(){
+    echo "file $1"
+    seq $1 $(($1 + 100))
+}
+
+echo "CRASH TEST"
+
+##################################################
+# committed transactions are redone after a crash in the middle of a workload
+
+(
+    i=0
+    while [ $i -lt 100000 ]
+    do
+        content $i > ${DIR}/seq$i 2>/dev/null || break
+        i=$((i+1))
+    done
+) &
+writer=$!
+sleep 2
+killall -9 chfs_client >/dev/null 2>&1
+wait $writer
+chfs_crash
+chfs_restart
+
+# files are written one after another, so every one before the last that
+# survived must be complete; the last may have lost its write
+n=0
+while [ -e ${DIR}/seq$n ]
+do
+    n=$((n+1))
+done
+if [ $n -eq 0 ];
+then
+    fail "no file of the workload survived"
+fi
+i=0
+while [ $i -lt $((n-1)) ]
+do
+    content $i | cmp -s - ${DIR}/seq$i || fail "seq$i differs after restart"
+    i=$((i+1))
+done
+last=$((n-1))
+if [ -s ${DIR}/seq$last ];
+then
+    content $last | cmp -s - ${DIR}/seq$last || fail "seq$last is torn"
+fi
+echo "recovered $n files"
+
+##################################################
+# transactions at or below the image's stamp are not redone again
+
+echo one > ${DIR}/stale
+chfs_crash
+cp ${LOGFILE} ${TMP}/old_log
+chfs_restart
+
+echo two > ${DIR}/stale
+# outgrow MAX_LOG_SZ, so that the image is synced and the log starts afresh
+dd if=/dev/urandom of=${TMP}/bulk bs=4096 count=64 >/dev/null 2>&1
+cp ${TMP}/bulk ${DIR}/bulk
+if [ `stat -c %s ${LOGFILE}` -ge `stat -c %s ${TMP}/bulk` ];
+then
+    fail "the log was not truncated after it outgrew MAX_LOG_SZ"
+fi
+chfs_crash
+
+# as if the log had not been truncated after the image was synced
+cat ${TMP}/old_log ${LOGFILE} > ${TMP}/log
+cp ${TMP}/log ${LOGFILE}
+chfs_restart
+[ "`cat ${DIR}/stale`" = "two" ] || fail "a transaction older than the image was redone"
+cmp -s ${TMP}/bulk ${DIR}/bulk || fail "bulk differs after restart"
+
+##################################################
+# a torn tail record is dropped, and with it the transaction it would commit
+
+printf AAAA > ${DIR}/tail
+# the last transaction before the crash
+printf BBBB | dd of=${DIR}/tail conv=notrunc >/dev/null 2>&1
+chfs_crash
+# cut the COMMIT record of that transaction in half
+truncate -s -4 ${LOGFILE}
+chfs_restart
+[ "`cat ${DIR}/tail`" = "AAAA" ] || fail "an uncommitted transaction was redone"
+
+# the log goes on after the last complete record
+printf CCCC | dd of=${DIR}/tail conv=notrunc >/dev/null 2>&1
+chfs_crash
+chfs_restart
+[ "`cat ${DIR}/tail`" = "CCCC" ] || fail "a transaction after a torn tail was lost"
+[ "`cat ${DIR}/stale`" = "two" ] || fail "stale differs after the second restart"
+content 0 | cmp -s - ${DIR}/seq0 || fail "seq0 differs after the second restart"
+
+rm -rf ${TMP}
+echo "Passed CRASH TEST"